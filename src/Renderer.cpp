@@ -2,9 +2,13 @@
 #include <iomanip>
 #include <optional>
 #include <chrono>
+#include <numeric>
+#include <algorithm>
 #include "Renderer.h"
 #include "common/Timer.h"
 #include "common/utils.h"
+#include "common/RayPacket.h"
+#include "common/TraversalStats.h"
 
 cv::Mat3f Renderer::render(const Scene &scene, const std::string &ckpt) const
 {
@@ -113,32 +117,71 @@ cv::Mat3f RayTracer::render(const Scene &scene, const std::string &ckpt) const
     }
 
     Timer timer;
+#if ENABLE_BVH_STATS
+    TraversalStats::reset();
+#endif
 
     int count = 0;
     int total = width * height;
+    // primary, extension and shadow rays, counted as in WavefrontTracer::render
+    uint64_t rays = total;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // primary rays are not jittered, so each pixel is traced once as part of a packet
+    // and its first hit is shared by all samples
+    static_assert(RAY_PACKET_SIZE == 4 || RAY_PACKET_SIZE == 8 || RAY_PACKET_SIZE == 16, "RAY_PACKET_SIZE must be 4, 8 or 16");
+    const int tileWidth = RAY_PACKET_SIZE == 4 ? 2 : 4;
+    const int tileHeight = RAY_PACKET_SIZE / tileWidth;
 
 #if ENABLE_OPENMP
-    #pragma omp parallel for
+    #pragma omp parallel for reduction(+ : rays)
 #endif
-    for (int j = 0; j < height; j++)
+    for (int tj = 0; tj < height; tj += tileHeight)
     {
-        for (int i = 0; i < width; i++)
+        for (int ti = 0; ti < width; ti += tileWidth)
         {
-            cv::Vec3f dir = scene.getRay(i, j);
-            for (int s = 0; s < m_spp; s++)
+            RayPacket packet(RAY_PACKET_SIZE);
+            cv::Vec3f dirs[RayPacket::maxSize];
+            for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
             {
-                frameBuffer(j, i) += scene.pathTracing(eyePos, dir) / (m_spp + spp);
+                int i = ti + lane % tileWidth;
+                int j = tj + lane / tileWidth;
+                if (i < width && j < height)
+                {
+                    dirs[lane] = scene.getRay(i, j);
+                    packet.setRay(lane, Ray(eyePos, dirs[lane]));
+                }
             }
+            std::optional<HitPayload> primary[RayPacket::maxSize];
+            scene.trace(packet, primary);
+
+            for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+            {
+                if (!(packet.validMask >> lane & 1))
+                {
+                    continue;
+                }
+                int i = ti + lane % tileWidth;
+                int j = tj + lane / tileWidth;
+                for (int s = 0; s < m_spp; s++)
+                {
+                    frameBuffer(j, i) += scene.pathTracing(eyePos, dirs[lane], primary[lane], &rays) / (m_spp + spp);
+                }
 #if ENABLE_OPENMP
-            #pragma omp critical
+                #pragma omp critical
 #endif
-            std::cout << "\r" << ++count << "/" << total << " (" << std::fixed << std::setprecision(3) << (count / (float)total * 100.0f) << "%)" << std::flush;
+                std::cout << "\r" << ++count << "/" << total << " (" << std::fixed << std::setprecision(3) << (count / (float)total * 100.0f) << "%)" << std::flush;
+            }
         }
     }
 
-    // auto end = std::chrono::high_resolution_clock::now();
+    auto end = std::chrono::high_resolution_clock::now();
 
-    // std::cout << "Time: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << std::endl << "Megakernel: " << rays << " rays in " << seconds << " s, " << rays / seconds / 1e6 << " MRays/s" << std::endl;
+#if ENABLE_BVH_STATS
+    std::cout << "BVH traversal: " << TraversalStats::collect() << std::endl;
+#endif
 
     return frameBuffer;
 }
@@ -168,3 +211,305 @@ std::optional<std::pair<cv::Mat3f, int>> RayTracer::getCkptFrameBuffer(const std
     }
     return std::nullopt;
 }
+
+void WavefrontTracer::PathStates::resize(size_t n)
+{
+    pixel.resize(n);
+    origin.resize(n);
+    dir.resize(n);
+    throughput.resize(n);
+    radiance.resize(n);
+    countEmission.resize(n);
+    bsdfPdf.resize(n);
+    bounceTexture.resize(n);
+    hit.resize(n);
+}
+
+void WavefrontTracer::ShadowRays::resize(size_t n)
+{
+    valid.resize(n);
+    from.resize(n);
+    to.resize(n);
+    contribution.resize(n);
+}
+
+WavefrontTracer::WavefrontTracer(int spp, int waveSize) :
+    RayTracer(spp, 1),
+    m_waveSize(waveSize)
+{
+
+}
+
+cv::Mat3f WavefrontTracer::render(const Scene &scene, const std::string &ckpt) const
+{
+    int width = scene.getWidth();
+    int height = scene.getHeight();
+    cv::Mat3f frameBuffer(height, width, cv::Vec3f(0.0f, 0.0f, 0.0f));
+
+    auto ckptFrameBuffer = getCkptFrameBuffer(ckpt);
+    int spp = 0;
+
+    if (ckptFrameBuffer.has_value())
+    {
+        auto & ckptFb = ckptFrameBuffer.value().first;
+        spp = ckptFrameBuffer.value().second;
+        assert(ckptFb.rows == height && ckptFb.cols == width);
+        frameBuffer = ckptFb;
+    }
+
+#if ENABLE_BVH_STATS
+    TraversalStats::reset();
+#endif
+
+    int total = width * height;
+    int pixelsPerWave = std::max(1, m_waveSize / m_spp);
+    PathStates paths;
+    paths.resize(static_cast<size_t>(pixelsPerWave) * m_spp);
+    ShadowRays shadows;
+    std::vector<int> queue;
+    std::vector<int> sorted;
+    std::vector<int> next;
+    uint64_t rays = 0;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int firstPixel = 0; firstPixel < total; firstPixel += pixelsPerWave)
+    {
+        int pixelCount = std::min(pixelsPerWave, total - firstPixel);
+        generate(scene, firstPixel, pixelCount, paths, queue);
+        rays += pixelCount;
+        while (true)
+        {
+            sortByMaterial(paths, queue, sorted);
+            if (sorted.empty())
+            {
+                break;
+            }
+            shadows.resize(sorted.size());
+            next.resize(sorted.size());
+            shade(scene, paths, sorted, shadows, next);
+            rays += connect(scene, paths, sorted, shadows);
+
+            // compact the paths that go on
+            queue.clear();
+            for (int path : next)
+            {
+                if (path >= 0)
+                {
+                    queue.push_back(path);
+                }
+            }
+            if (queue.empty())
+            {
+                break;
+            }
+            extend(scene, paths, queue);
+            rays += queue.size();
+        }
+
+        for (int path = 0; path < pixelCount * m_spp; path++)
+        {
+            int pixel = paths.pixel[path];
+            frameBuffer(pixel / width, pixel % width) += paths.radiance[path] / (m_spp + spp);
+        }
+        int count = firstPixel + pixelCount;
+        std::cout << "\r" << count << "/" << total << " (" << std::fixed << std::setprecision(3) << (count / (float)total * 100.0f) << "%)" << std::flush;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << std::endl << "Wavefront: " << rays << " rays in " << seconds << " s, " << rays / seconds / 1e6 << " MRays/s" << std::endl;
+#if ENABLE_BVH_STATS
+    std::cout << "BVH traversal: " << TraversalStats::collect() << std::endl;
+#endif
+
+    return frameBuffer;
+}
+
+void WavefrontTracer::generate(const Scene &scene, int firstPixel, int pixelCount, PathStates &paths, std::vector<int> &queue) const
+{
+    int width = scene.getWidth();
+    cv::Vec3f eyePos = scene.getEyePos();
+    int packetCount = (pixelCount + RAY_PACKET_SIZE - 1) / RAY_PACKET_SIZE;
+
+    // primary rays are not jittered, the samples of a pixel share its first hit as in RayTracer
+#if ENABLE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int b = 0; b < packetCount; b++)
+    {
+        RayPacket packet(RAY_PACKET_SIZE);
+        cv::Vec3f dirs[RayPacket::maxSize];
+        int count = std::min(RAY_PACKET_SIZE, pixelCount - b * RAY_PACKET_SIZE);
+        for (int lane = 0; lane < count; lane++)
+        {
+            int pixel = firstPixel + b * RAY_PACKET_SIZE + lane;
+            dirs[lane] = scene.getRay(pixel % width, pixel / width);
+            packet.setRay(lane, Ray(eyePos, dirs[lane]));
+        }
+        std::optional<HitPayload> primary[RayPacket::maxSize];
+        scene.trace(packet, primary);
+
+        for (int lane = 0; lane < count; lane++)
+        {
+            BVH_STATS_ADD(paths, m_spp);
+            for (int s = 0; s < m_spp; s++)
+            {
+                int path = (b * RAY_PACKET_SIZE + lane) * m_spp + s;
+                paths.pixel[path] = firstPixel + b * RAY_PACKET_SIZE + lane;
+                paths.origin[path] = eyePos;
+                paths.dir[path] = dirs[lane];
+                paths.throughput[path] = cv::Vec3f(1, 1, 1);
+                paths.radiance[path] = cv::Vec3f(0, 0, 0);
+                paths.countEmission[path] = true;
+                paths.bsdfPdf[path] = 0;
+                paths.hit[path] = primary[lane];
+            }
+        }
+    }
+
+    queue.resize(pixelCount * m_spp);
+    std::iota(queue.begin(), queue.end(), 0);
+}
+
+void WavefrontTracer::extend(const Scene &scene, PathStates &paths, const std::vector<int> &queue) const
+{
+#if ENABLE_OPENMP
+    #pragma omp parallel for schedule(dynamic, 64)
+#endif
+    for (size_t k = 0; k < queue.size(); k++)
+    {
+        int path = queue[k];
+        paths.hit[path] = scene.trace(Ray(paths.origin[path], paths.dir[path]));
+        BVH_STATS_ADD(pathSegments, 1);
+    }
+}
+
+void WavefrontTracer::sortByMaterial(const PathStates &paths, const std::vector<int> &queue, std::vector<int> &sorted) const
+{
+    auto group = [&](int path) {
+        const std::optional<HitPayload> &hit = paths.hit[path];
+        if (!hit.has_value())
+        {
+            return -1;
+        }
+        return hit->emissive() ? 0 : 1 + static_cast<int>(hit->hitObj->getMaterialType());
+    };
+
+    // counting sort, stable so that the paths of a group keep the order of their pixels
+    std::vector<int> groups(queue.size());
+    int offsets[materialGroups + 1] = {};
+    for (size_t k = 0; k < queue.size(); k++)
+    {
+        groups[k] = group(queue[k]);
+        if (groups[k] >= 0)
+        {
+            offsets[groups[k] + 1]++;
+        }
+    }
+    for (int g = 0; g < materialGroups; g++)
+    {
+        offsets[g + 1] += offsets[g];
+    }
+    sorted.resize(offsets[materialGroups]);
+    for (size_t k = 0; k < queue.size(); k++)
+    {
+        if (groups[k] >= 0)
+        {
+            sorted[offsets[groups[k]]++] = queue[k];
+        }
+    }
+}
+
+void WavefrontTracer::shade(const Scene &scene, PathStates &paths, const std::vector<int> &queue, ShadowRays &shadows, std::vector<int> &next) const
+{
+    float russianRoulette = scene.getRussianRoulette();
+
+#if ENABLE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (size_t k = 0; k < queue.size(); k++)
+    {
+        int path = queue[k];
+        const HitPayload &hit = paths.hit[path].value();
+        cv::Vec3f &throughput = paths.throughput[path];
+        shadows.valid[k] = false;
+        next[k] = -1;
+
+        // the same steps as one iteration of Scene::pathTracing, with the shadow ray left to connect
+        if (hit.emissive())
+        {
+            if (paths.countEmission[path])
+            {
+                paths.radiance[path] += throughput.mul(hit.emission);
+            }
+            else if (paths.bsdfPdf[path] > 0)
+            {
+                float pdf = scene.lightPdf(paths.origin[path], hit);
+                if (pdf > 0)
+                {
+                    paths.radiance[path] += throughput.mul(hit.emission).mul(paths.bounceTexture[path]) * zoe::powerHeuristic(paths.bsdfPdf[path], pdf);
+                }
+            }
+            continue;
+        }
+
+        const Object *hitObj = hit.hitObj;
+        cv::Vec3f hitNormal = cv::normalize(hit.normal);
+        Material::MaterialType type = hitObj->getMaterialType();
+        bool mis = scene.getMIS() && (type == Material::MaterialType::DIFFUSE_AND_GLOSSY || type == Material::MaterialType::DIFFUSE_AND_REFLECTION);
+        bool diffuse = type != Material::MaterialType::REFLECTION && type != Material::MaterialType::REFLECTION_AND_REFRACTION;
+        if (diffuse)
+        {
+            auto [light, lightPdf] = scene.sampleLight(hit.point);
+            if (lightPdf > 0)
+            {
+                shadows.valid[k] = true;
+                shadows.from[k] = light.point;
+                shadows.to[k] = hit.point;
+                shadows.contribution[k] = throughput.mul(scene.evalDirectLight(light, lightPdf, hitObj, hit.st, hit.point, paths.dir[path], hitNormal, mis));
+            }
+        }
+
+        if (zoe::randomFloat() >= russianRoulette)
+        {
+            continue;
+        }
+        BSDFSample bsdf = hitObj->getMaterial().sample(hitNormal, paths.dir[path]);
+        if (bsdf.pdf <= zoe::denominatorEpsilon)
+        {
+            continue;
+        }
+        float cosTheta = std::abs(bsdf.dir.dot(hitNormal));
+        throughput = throughput.mul(bsdf.value) * cosTheta / (bsdf.pdf * russianRoulette);
+        paths.countEmission[path] = !diffuse;
+        paths.bsdfPdf[path] = mis ? bsdf.pdf : 0;
+        if (mis)
+        {
+            paths.bounceTexture[path] = hitObj->getDiffuseColor(hit.st);
+        }
+        paths.origin[path] = hit.point;
+        paths.dir[path] = bsdf.dir;
+        next[k] = path;
+    }
+}
+
+size_t WavefrontTracer::connect(const Scene &scene, PathStates &paths, const std::vector<int> &queue, const ShadowRays &shadows) const
+{
+    size_t count = 0;
+#if ENABLE_OPENMP
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+ : count)
+#endif
+    for (size_t k = 0; k < queue.size(); k++)
+    {
+        if (!shadows.valid[k])
+        {
+            continue;
+        }
+        count++;
+        if (scene.visible(shadows.from[k], shadows.to[k]))
+        {
+            paths.radiance[queue[k]] += shadows.contribution[k];
+        }
+    }
+    return count;
+}
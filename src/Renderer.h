@@ -1,6 +1,8 @@
 #ifndef __RENDERER_H__
 #define __RENDERER_H__
 
+#include <vector>
+#include <cstdint>
 #include <opencv2/opencv.hpp>
 #include "objects/Object.h"
 #include "Scene.h"
@@ -30,4 +32,66 @@ public:
 
 };
 
+/**
+ * @brief Wavefront path tracer. Instead of following one path to its end, a wave of paths advances one bounce
+ *        at a time through four stages, each a loop over a queue of paths: generate camera rays, extend them to
+ *        their closest hits, shade the hits grouped by material, and connect the light samples with shadow rays.
+ *        Paths that end are compacted out of the queue between bounces. The estimate is that of Scene::pathTracing.
+ */
+class WavefrontTracer : public RayTracer
+{
+private:
+    // the state of the paths of a wave, one array per field so that a stage only streams the fields it uses
+    struct PathStates
+    {
+        std::vector<int> pixel;
+        std::vector<cv::Vec3f> origin;          // the camera or the point the last bounce left from
+        std::vector<cv::Vec3f> dir;
+        std::vector<cv::Vec3f> throughput;
+        std::vector<cv::Vec3f> radiance;
+        std::vector<uint8_t> countEmission;
+        // for MIS, the BSDF pdf of the last bounce and the texture at its origin
+        std::vector<float> bsdfPdf;
+        std::vector<cv::Vec3f> bounceTexture;
+        std::vector<std::optional<HitPayload>> hit;
+
+        void resize(size_t n);
+    };
+
+    // the shadow rays of a bounce, slot k belongs to the k-th path of the shade queue
+    struct ShadowRays
+    {
+        std::vector<uint8_t> valid;
+        std::vector<cv::Vec3f> from;            // the light sample
+        std::vector<cv::Vec3f> to;              // the shading point
+        std::vector<cv::Vec3f> contribution;    // added to the path if nothing lies in between
+
+        void resize(size_t n);
+    };
+
+    // shading groups, emitters first and then one per material type
+    static constexpr int materialGroups = 1 + Material::materialTypeCount;
+
+    int m_waveSize;
+
+    // the camera paths of pixels [firstPixel, firstPixel + pixelCount), the primary rays are traced in packets
+    void generate(const Scene &scene, int firstPixel, int pixelCount, PathStates &paths, std::vector<int> &queue) const;
+    void extend(const Scene &scene, PathStates &paths, const std::vector<int> &queue) const;
+    // drops the paths that left the scene and orders the rest by shading group, so that neighbours shade alike
+    void sortByMaterial(const PathStates &paths, const std::vector<int> &queue, std::vector<int> &sorted) const;
+    // next[k] receives the path of queue[k] if it goes on, otherwise -1
+    void shade(const Scene &scene, PathStates &paths, const std::vector<int> &queue, ShadowRays &shadows, std::vector<int> &next) const;
+    // returns the number of shadow rays traced
+    size_t connect(const Scene &scene, PathStates &paths, const std::vector<int> &queue, const ShadowRays &shadows) const;
+
+public:
+    /**
+     * @param waveSize The number of paths in flight, all samples of a pixel are in the same wave
+     */
+    WavefrontTracer(int spp = 32, int waveSize = 1 << 14);
+    virtual ~WavefrontTracer() = default;
+
+    virtual cv::Mat3f render(const Scene &scene, const std::string &ckpt = "") const override;
+};
+
 #endif
\ No newline at end of file
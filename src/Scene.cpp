@@ -1,5 +1,8 @@
 #include <opencv2/opencv.hpp>
+#include <algorithm>
 #include <numeric>
+#include <chrono>
+#include "common/TraversalStats.h"
 #include "common/utils.h"
 #include "Scene.h"
 
@@ -11,23 +14,35 @@ Scene::Scene(const Camera &camera, const cv::Vec3f &bgColor) :
     m_lights = std::vector<std::shared_ptr<Light>>();
 }
 
-std::pair<HitPayload, float> Scene::sampleLight() const
+std::pair<HitPayload, float> Scene::sampleLight(const cv::Vec3f &point) const
 {
-    float prob = zoe::randomFloat() * m_totalLightArea;
+    if (m_lightObjects.empty())
+    {
+        throw std::runtime_error("No light found");
+    }
+    float target = zoe::randomFloat() * m_lightCdf.back();
+    // round-off can put target at the very end of the table, which then picks the last light
+    size_t i = std::upper_bound(m_lightCdf.begin(), m_lightCdf.end(), target) - m_lightCdf.begin();
+    const Object *light = m_lightObjects[std::min(i, m_lightObjects.size() - 1)];
+    HitPayload sample = light->samplePoint();
+    return std::make_pair(sample, lightPdf(point, sample));
+}
 
-    float emitArea = 0;
-    for (const auto &obj : m_objects) 
+float Scene::lightPdf(const cv::Vec3f &point, const HitPayload &lightHit) const
+{
+    if (m_lightObjects.empty())
     {
-        if (obj->emissive()) 
-        {
-            emitArea += obj->getArea();
-            if (prob <= emitArea) 
-            {
-                return std::make_pair(obj->samplePoint(), 1 / m_totalLightArea);
-            }
-        }
+        return 0;
     }
-    throw std::runtime_error("No light found");
+    // uniform over the emissive area, converted from area to solid angle at point
+    cv::Vec3f d = point - lightHit.point;
+    float dist2 = d.dot(d);
+    float cosLight = cv::normalize(d).dot(cv::normalize(lightHit.normal));
+    if (cosLight <= 0 || dist2 <= 0)
+    {
+        return 0;
+    }
+    return dist2 / (cosLight * m_lightCdf.back());
 }
 
 void Scene::add(std::shared_ptr<Object> object)
@@ -35,7 +50,8 @@ void Scene::add(std::shared_ptr<Object> object)
     m_objects.push_back(object);
     if (object->emissive())
     {
-        m_totalLightArea += object->getArea();
+        m_lightObjects.push_back(object.get());
+        m_lightCdf.push_back((m_lightCdf.empty() ? 0 : m_lightCdf.back()) + object->getArea());
     }
 }
 
@@ -57,8 +73,8 @@ cv::Vec3f Scene::castRay(const cv::Vec3f &eyePos, const cv::Vec3f &dir, int dept
     {
         auto [uv, hitObj, tNear, emission] = payload.value();
         cv::Vec3f hitPoint = eyePos + dir * tNear;
-        cv::Vec3f hitNormal = hitObj->getNormal(hitPoint);
-        cv::Vec2f st = hitObj->getTexCoords(uv);
+        cv::Vec3f hitNormal = payload->normal;
+        cv::Vec2f st = payload->st;
         switch (hitObj->getMaterialType())
         {
         // only reflection
@@ -100,17 +116,7 @@ cv::Vec3f Scene::castRay(const cv::Vec3f &eyePos, const cv::Vec3f &dir, int dept
                 for (const auto &light : m_lights)
                 {
                     cv::Vec3f lightDir = cv::normalize(light->getPos() - hitPoint);
-                    std::optional<HitPayload> payload = trace(Ray(shadowOrig, lightDir));
-                    if (payload.has_value())
-                    {
-                        auto [uv, hitObj, tNear, emission] = payload.value();
-                        if (cv::norm(tNear) >= cv::norm(light->getPos() - hitPoint))
-                        {
-                            // is shadow
-                            lightAmt += light->getIntensity() * std::max(0.0f, hitNormal.dot(lightDir));
-                        }
-                    }
-                    else
+                    if (visible(shadowOrig, light->getPos()))
                     {
                         lightAmt += light->getIntensity() * std::max(0.0f, hitNormal.dot(lightDir));
                     }
@@ -127,146 +133,199 @@ cv::Vec3f Scene::castRay(const cv::Vec3f &eyePos, const cv::Vec3f &dir, int dept
 
 std::optional<HitPayload> Scene::trace(const Ray &ray) const
 {
-    float nearest = std::numeric_limits<float>::max();
-    std::optional<HitPayload> hitPayload;
+    BVH_STATS_ADD(traces, 1);
+    // only distances are compared here, the payload is built once for the nearest hit
+    Ray r = ray;
+    const Object *nearestObj = nullptr;
+    int nearestPrim = 0;
+    PrimitiveHit nearest;
+    float nearestTMax = 0;
     for (const auto &obj : m_objects)
     {
-        auto res = obj->intersect(ray);
-        if (res.has_value())
+        for (int prim = 0; prim < obj->getPrimitiveCount(); prim++)
         {
-            if (res->dist > zoe::selfCrossEpsilon && res->dist < nearest)
+            PrimitiveHit hit;
+            if (obj->hitPrimitive(r, prim, hit) && hit.t > zoe::selfCrossEpsilon && (nearestObj == nullptr || hit.t < nearest.t))
             {
-                nearest = res->dist;
-                hitPayload = res.value();
+                nearestObj = obj.get();
+                nearestPrim = prim;
+                nearest = hit;
+                nearestTMax = r.getTMax();
+                r.setTMax(hit.t);
             }
         }
     }
-    return hitPayload;
+    if (nearestObj == nullptr)
+    {
+        return std::nullopt;
+    }
+    r.setTMax(nearestTMax);
+    return nearestObj->makePrimitiveHit(r, nearestPrim, nearest);
 }
 
-cv::Vec3f Scene::pathTracing(const cv::Vec3f &eyePos, const cv::Vec3f &dir) const
+void Scene::trace(const RayPacket &packet, std::optional<HitPayload> *hits) const
 {
-    cv::Vec3f directLight;
-    cv::Vec3f indirectLight;
-    std::optional<HitPayload> payload = trace(Ray(eyePos, dir));
-    if (payload.has_value())
+    for (int i = 0; i < packet.size; i++)
     {
-        if (payload->emission != cv::Vec3f(0, 0, 0))
+        if (packet.validMask >> i & 1)
         {
-            return payload->emission;
+            hits[i] = trace(packet.getRay(i));
         }
+    }
+}
 
-        auto [uv, hitObj, tNear, emission] = payload.value();
-        cv::Vec3f hitPoint = payload->point;
-        cv::Vec3f hitNormal = cv::normalize(hitObj->getNormal(hitPoint));
+bool Scene::visible(const cv::Vec3f &a, const cv::Vec3f &b) const
+{
+    cv::Vec3f d = b - a;
+    Ray ray(a, d, cv::norm(d) - zoe::selfCrossEpsilon);
+    for (const auto &obj : m_objects)
+    {
+        if (obj->occluded(ray))
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-        // sample the light
-        auto [light, lightPdf] = sampleLight();
-        cv::Vec3f lightPos = light.point;
-        // from light to object
-        cv::Vec3f lightDir = cv::normalize(hitPoint - lightPos);
-        cv::Vec3f lightNormal = cv::normalize(light.hitObj->getNormal(lightPos));
-        float dis = cv::norm(lightPos - hitPoint);
+cv::Vec3f Scene::pathTracing(const cv::Vec3f &eyePos, const cv::Vec3f &dir) const
+{
+    BVH_STATS_ADD(pathSegments, 1);
+    return pathTracing(eyePos, dir, trace(Ray(eyePos, dir)));
+}
 
-        switch (hitObj->getMaterialType())
+cv::Vec3f Scene::pathTracing(const cv::Vec3f &eyePos, const cv::Vec3f &dir, const std::optional<HitPayload> &payload, uint64_t *rays) const
+{
+    BVH_STATS_ADD(paths, 1);
+    cv::Vec3f radiance(0, 0, 0);
+    // product of BRDF * cos / pdf over the bounces so far
+    cv::Vec3f throughput(1, 1, 1);
+    // emitters hit by camera rays and by specular bounces count, the ones after a diffuse bounce are in the direct light
+    bool countEmission = true;
+    // with MIS, the BSDF pdf of the last bounce, the point it left from and the texture there
+    float bsdfPdf = 0;
+    cv::Vec3f bouncePoint;
+    cv::Vec3f bounceTexture;
+    cv::Vec3f rayDir = dir;
+    std::optional<HitPayload> hit = payload;
+    while (hit.has_value())
+    {
+        if (hit->emissive())
         {
-            case Material::MaterialType::DIFFUSE_AND_GLOSSY:
+            if (countEmission)
             {
-                directLight = calDirectLight(lightPos, lightDir, lightNormal, lightPdf, light.emission, dir, hitNormal, dis);
-                indirectLight = calIndirectLight(hitObj, hitNormal, hitPoint, dir);
-                return directLight + indirectLight;
+                radiance += throughput.mul(hit->emission);
             }
-            case Material::MaterialType::REFLECTION:
+            else if (bsdfPdf > 0)
             {
-                return calIndirectLight(hitObj, hitNormal, hitPoint, dir, true);
+                // the emitter found by BSDF sampling, weighted against the light sample taken at the last bounce;
+                // light samples only see the front of an emitter, so its back adds nothing here either
+                float pdf = lightPdf(bouncePoint, hit.value());
+                if (pdf > 0)
+                {
+                    radiance += throughput.mul(hit->emission).mul(bounceTexture) * zoe::powerHeuristic(bsdfPdf, pdf);
+                }
             }
+            break;
+        }
+
+        const Object *hitObj = hit->hitObj;
+        cv::Vec3f hitPoint = hit->point;
+        cv::Vec3f hitNormal = cv::normalize(hit->normal);
+        Material::MaterialType type = hitObj->getMaterialType();
+        // the refractive diffuse material mostly samples a delta lobe, its pdf is not a density to weight against
+        bool mis = m_mis && (type == Material::MaterialType::DIFFUSE_AND_GLOSSY || type == Material::MaterialType::DIFFUSE_AND_REFLECTION);
+        bool diffuse = true;
+        switch (type)
+        {
+            case Material::MaterialType::REFLECTION:
             case Material::MaterialType::REFLECTION_AND_REFRACTION:
             {
-                return calIndirectLight(hitObj, hitNormal, hitPoint, dir, true);
+                diffuse = false;
+                break;
             }
+            case Material::MaterialType::DIFFUSE_AND_GLOSSY:
             case Material::MaterialType::DIFFUSE_AND_REFLECTION:
-            {
-                directLight = calDirectLight(lightPos, lightDir, lightNormal, lightPdf, light.emission, dir, hitNormal, dis);
-                indirectLight = calIndirectLight(hitObj, hitNormal, hitPoint, dir);
-                return directLight + indirectLight;
-            }
             case Material::MaterialType::DIFFUSE_AND_REFRACTION:
             {
-                directLight = calDirectLight(lightPos, lightDir, lightNormal, lightPdf, light.emission, dir, hitNormal, dis);
-                indirectLight = calIndirectLight(hitObj, hitNormal, hitPoint, dir);
-                return directLight + indirectLight;
+                // sample the light
+                auto [light, lightPdf] = sampleLight(hitPoint);
+                radiance += throughput.mul(calDirectLight(light, lightPdf, hitObj, hit->st, hitPoint, rayDir, hitNormal, mis));
+                // calDirectLight casts a shadow ray unless the light faces away
+                if (rays != nullptr && lightPdf > 0)
+                {
+                    ++*rays;
+                }
+                break;
             }
         }
+
+        // indirect light, the segment is traced once and its hit shaded in the next iteration
+        if (zoe::randomFloat() >= getRussianRoulette())
+        {
+            break;
+        }
+        BSDFSample bsdf = hitObj->getMaterial().sample(hitNormal, rayDir);
+        if (bsdf.pdf <= zoe::denominatorEpsilon)
+        {
+            break;
+        }
+        std::optional<HitPayload> next = trace(Ray(hitPoint, bsdf.dir));
+        BVH_STATS_ADD(pathSegments, 1);
+        if (rays != nullptr)
+        {
+            ++*rays;
+        }
+        if (!next.has_value())
+        {
+            break;
+        }
+        // transmitted directions are below the surface, their cosine counts with its magnitude
+        float cosTheta = std::abs(bsdf.dir.dot(hitNormal));
+        throughput = throughput.mul(bsdf.value) * cosTheta / (bsdf.pdf * m_russianRoulette);
+        countEmission = !diffuse;
+        bsdfPdf = mis ? bsdf.pdf : 0;
+        if (mis)
+        {
+            bouncePoint = hitPoint;
+            bounceTexture = hitObj->getDiffuseColor(hit->st);
+        }
+        rayDir = bsdf.dir;
+        hit = std::move(next);
     }
-    return cv::Vec3f(0, 0, 0);
+    return radiance;
 }
 
-cv::Vec3f Scene::calDirectLight(const cv::Vec3f &lightPos, const cv::Vec3f &lightDir, const cv::Vec3f &lightNormal, float lightPdf, const cv::Vec3f &emission, const cv::Vec3f &dir, const cv::Vec3f &hitNormal, float dis) const
+cv::Vec3f Scene::calDirectLight(const HitPayload &light, float lightPdf, const Object *hitObj, const cv::Vec2f &st, const cv::Vec3f &hitPoint, const cv::Vec3f &dir, const cv::Vec3f &hitNormal, bool mis) const
 {
-    std::optional<HitPayload> shadowPayload = trace(Ray(lightPos, lightDir));
     // if the light is not occluded
-    if (shadowPayload.has_value() && std::abs(shadowPayload->dist - dis) <= zoe::selfCrossEpsilon)
+    if (lightPdf > 0 && visible(light.point, hitPoint))
     {
-        cv::Vec3f textureColor = shadowPayload->hitObj->getDiffuseColor(shadowPayload->uv);
-        cv::Vec3f lightColor = emission;
-        cv::Vec3f contri = shadowPayload->hitObj->evalLightBRDF(hitNormal, dir, -lightDir);
-        float cosTheta = -lightDir.dot(hitNormal);
-        float cosPhi = lightDir.dot(lightNormal);
-#if OUTPUT_DEBUG_LOG
-        std::cout << "========== direct light ==========" << std::endl;
-        std::cout << "textureColor = " << textureColor << std::endl;
-        std::cout << "lightColor = " << lightColor << std::endl;
-        std::cout << "contri = " << contri << std::endl;
-        std::cout << "cosTheta = " << cosTheta << std::endl;
-        std::cout << "cosPhi = " << cosPhi << std::endl;
-        std::cout << "lightPdf = " << lightPdf << std::endl;
-        std::cout << "dis = " << dis << std::endl;
-        std::cout << "directLight = " << lightColor.mul(contri) * cosTheta * cosPhi / (lightPdf * dis * dis) << std::endl;
-        std::cout << std::endl;
-#endif
-        cv::Vec3f res = lightColor.mul(contri).mul(textureColor) * cosTheta * cosPhi / (lightPdf * dis * dis);
-        return res;
+        return evalDirectLight(light, lightPdf, hitObj, st, hitPoint, dir, hitNormal, mis);
     }
     return cv::Vec3f(0, 0, 0);
 }
 
-cv::Vec3f Scene::calIndirectLight(const std::shared_ptr<const Object> &hitObj, const cv::Vec3f &hitNormal, const cv::Vec3f &hitPoint, const cv::Vec3f &dir, bool addDirectLight) const
+cv::Vec3f Scene::evalDirectLight(const HitPayload &light, float lightPdf, const Object *hitObj, const cv::Vec2f &st, const cv::Vec3f &hitPoint, const cv::Vec3f &dir, const cv::Vec3f &hitNormal, bool mis) const
 {
-    // indirect light
-    if (zoe::randomFloat() < getRussianRoulette())
-    {
-        cv::Vec3f wi = cv::normalize(hitObj->getMaterial().sampleDir(hitNormal, dir));
-        std::optional<HitPayload> indirectPayload = trace(Ray(hitPoint, wi));
-        if (!addDirectLight)
-        {
-            if (indirectPayload.has_value() 
-                && !indirectPayload->emissive())
-            {
-                cv::Vec3f contri = hitObj->evalLightBRDF(hitNormal, dir, wi);
-                float cosTheta = wi.dot(hitNormal);
-                float pdf = hitObj->getMaterial().pdf(hitNormal, dir, wi);
-                if (pdf > zoe::denominatorEpsilon)
-                {
-                    cv::Vec3f res = pathTracing(hitPoint, wi).mul(contri) * cosTheta / (pdf * m_russianRoulette);
-                    return res;
-                }
-            }
-        }
-        else
-        {
-            if (indirectPayload.has_value())
-            {
-                cv::Vec3f contri = hitObj->evalLightBRDF(hitNormal, dir, wi);
-                float cosTheta = wi.dot(hitNormal);
-                float pdf = hitObj->getMaterial().pdf(hitNormal, dir, wi);
-                if (pdf > zoe::denominatorEpsilon)
-                {
-                    return pathTracing(hitPoint, wi).mul(contri) * std::abs(cosTheta) / (pdf * m_russianRoulette);
-                }
-            }
-        }
-    }
-    return cv::Vec3f(0, 0, 0);
+    // from object to light
+    cv::Vec3f wi = cv::normalize(light.point - hitPoint);
+    const Material &material = hitObj->getMaterial();
+    cv::Vec3f textureColor = hitObj->getDiffuseColor(st);
+    cv::Vec3f contri = material.eval(hitNormal, dir, wi);
+    float cosTheta = wi.dot(hitNormal);
+    float weight = mis ? zoe::powerHeuristic(lightPdf, material.pdf(hitNormal, dir, wi)) : 1.0f;
+#if OUTPUT_DEBUG_LOG
+    std::cout << "========== direct light ==========" << std::endl;
+    std::cout << "textureColor = " << textureColor << std::endl;
+    std::cout << "lightColor = " << light.emission << std::endl;
+    std::cout << "contri = " << contri << std::endl;
+    std::cout << "cosTheta = " << cosTheta << std::endl;
+    std::cout << "lightPdf = " << lightPdf << std::endl;
+    std::cout << "weight = " << weight << std::endl;
+    std::cout << std::endl;
+#endif
+    return light.emission.mul(contri).mul(textureColor) * cosTheta * weight / lightPdf;
 }
 
 cv::Vec3f Scene::getRay(int x, int y) const
@@ -276,16 +335,108 @@ cv::Vec3f Scene::getRay(int x, int y) const
 
 std::optional<HitPayload> BVHScene::trace(const Ray &ray) const
 {
+    BVH_STATS_ADD(traces, 1);
+    if (m_bvh8)
+    {
+        return m_bvh8->intersect(ray);
+    }
+    if (m_bvh4)
+    {
+        return m_bvh4->intersect(ray);
+    }
     return m_bvh->intersect(ray);
 }
 
+void BVHScene::trace(const RayPacket &packet, std::optional<HitPayload> *hits) const
+{
+    // packets walk the binary BVH, the wide ones already test several boxes per ray
+    m_bvh->intersect(packet, hits);
+}
+
+bool BVHScene::visible(const cv::Vec3f &a, const cv::Vec3f &b) const
+{
+    cv::Vec3f d = b - a;
+    Ray ray(a, d);
+    float tMax = cv::norm(d) - zoe::selfCrossEpsilon;
+    if (m_bvh8)
+    {
+        return !m_bvh8->occluded(ray, tMax);
+    }
+    if (m_bvh4)
+    {
+        return !m_bvh4->occluded(ray, tMax);
+    }
+    return !m_bvh->occluded(ray, tMax);
+}
+
 BVHScene::BVHScene(const Camera &camera, const cv::Vec3f &bgColor) : Scene(camera, bgColor)
 {
 
 }
 
-void BVHScene::buildBVH()
+void BVHScene::buildBVH(const BVHBuildConfig &config)
 {
+    if (!m_bvhCachePath.empty())
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        m_bvh = BVH::loadCache(m_bvhCachePath, getObjects(), config);
+        if (m_bvh)
+        {
+            auto end = std::chrono::high_resolution_clock::now();
+            std::cout << "Loaded BVH cache " << m_bvhCachePath << " in " << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+            buildWideBVH(config);
+            return;
+        }
+    }
+
     std::cout << "Building BVH..." << std::endl;
-    m_bvh = std::make_shared<BVH>(getObjects());
+    m_bvh = std::make_shared<BVH>(getObjects(), config);
+    const BVH::BuildTimes &times = m_bvh->getBuildTimes();
+    std::cout << "BVH build time: bounds " << times.bounds << " ms, build " << times.build << " ms, flatten " << times.flatten << " ms" << std::endl;
+    if (!m_bvhCachePath.empty() && m_bvh->saveCache(m_bvhCachePath))
+    {
+        std::cout << "Saved BVH cache " << m_bvhCachePath << std::endl;
+    }
+    buildWideBVH(config);
+    std::cout << m_bvh->getStats() << std::endl;
+}
+
+void BVHScene::updateBVH()
+{
+    if (!m_bvh)
+    {
+        buildBVH();
+        return;
+    }
+
+    BVHBuildConfig config = m_bvh->getConfig();
+    if (!m_bvh->refit())
+    {
+        std::cout << "SAH cost grew by " << m_bvh->getSAHGrowth() << "x after refit, rebuilding BVH" << std::endl;
+        m_bvh = std::make_shared<BVH>(getObjects(), config);
+    }
+    // the wide hierarchies copy the bounds, collapse them again
+    buildWideBVH(config);
+}
+
+void BVHScene::buildWideBVH(const BVHBuildConfig &config)
+{
+    m_bvh4 = nullptr;
+    m_bvh8 = nullptr;
+    int width = config.width;
+    if (width == 8 && !zoe::cpuSupportsAVX2())
+    {
+        std::cout << "AVX2 is not supported, falling back to BVH4" << std::endl;
+        width = 4;
+    }
+    if (width == 8)
+    {
+        m_bvh8 = std::make_shared<BVH8>(m_bvh, config.quantizeWideNodes);
+        std::cout << "BVH8 nodes: " << m_bvh8->getNodeCount() << ", memory " << m_bvh8->getMemoryBytes() / 1024.0 << " KiB" << std::endl;
+    }
+    else if (width == 4)
+    {
+        m_bvh4 = std::make_shared<BVH4>(m_bvh, config.quantizeWideNodes);
+        std::cout << "BVH4 nodes: " << m_bvh4->getNodeCount() << ", memory " << m_bvh4->getMemoryBytes() / 1024.0 << " KiB" << std::endl;
+    }
 }
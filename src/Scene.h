@@ -3,6 +3,7 @@
 
 #include <opencv2/opencv.hpp>
 #include "common/BVH.h"
+#include "common/WideBVH.h"
 #include "common/Light.h"
 #include "common/Camera.h"
 #include "objects/Object.h"
@@ -13,6 +14,8 @@ private:
     int m_maxDepth = 5;
     double m_epsilon = 0.00001;
     float m_russianRoulette = 0.8;
+    // combine light and BSDF sampling of direct light with the power heuristic
+    bool m_mis = true;
 
     Camera m_camera;
     cv::Vec3f m_bgColor;
@@ -20,7 +23,9 @@ private:
     std::vector<std::shared_ptr<Object>> m_objects;
     std::vector<std::shared_ptr<Light>> m_lights;
 
-    float m_totalLightArea = 0.0;
+    // emissive objects and their cumulative areas, so that a light is picked by binary search
+    std::vector<const Object *> m_lightObjects;
+    std::vector<float> m_lightCdf;
 
 public:
     Scene() { }
@@ -48,6 +53,37 @@ public:
     */
     virtual std::optional<HitPayload> trace(const Ray &ray) const;
 
+    /**
+     * @brief Trace a packet of rays, e.g. the primary rays of a tile of pixels.
+     * @param packet The rays, one per lane.
+     * @param hits Lane i receives the closest object hit by ray i.
+    */
+    virtual void trace(const RayPacket &packet, std::optional<HitPayload> *hits) const;
+
+    /**
+     * @brief Shadow ray test between two points, stops at the first blocker.
+     * @param a The start point, e.g. the sampled light position.
+     * @param b The end point, e.g. the shading point.
+     * @return Whether nothing lies between a and b.
+    */
+    virtual bool visible(const cv::Vec3f &a, const cv::Vec3f &b) const;
+
+    /**
+     * @brief Sample a point uniformly over the area of all emissive objects, in O(log L) for L of them
+     * @param point The shading point the light is sampled for
+     * @return The sampled point and its pdf with respect to solid angle at point, 0 if the light faces away
+     */
+    std::pair<HitPayload, float> sampleLight(const cv::Vec3f &point) const;
+
+    /**
+     * @brief The pdf with respect to solid angle at point with which sampleLight would have chosen lightHit,
+     *        e.g. an emitter found by BSDF sampling
+     */
+    float lightPdf(const cv::Vec3f &point, const HitPayload &lightHit) const;
+
+    // the light arriving at hitPoint from a light sample without the shadow ray, for callers that test the visibility themselves
+    cv::Vec3f evalDirectLight(const HitPayload &light, float lightPdf, const Object *hitObj, const cv::Vec2f &st, const cv::Vec3f &hitPoint, const cv::Vec3f &dir, const cv::Vec3f &hitNormal, bool mis) const;
+
     /**
      * @brief Path tracing algorithm.
      * @param eyePos The position of the camera.
@@ -57,6 +93,14 @@ public:
      */
     virtual cv::Vec3f pathTracing(const cv::Vec3f &eyePos, const cv::Vec3f &dir) const;
 
+    /**
+     * @brief Path tracing from an already traced first hit, e.g. a primary hit shared by all samples of a pixel.
+     *        The path is extended in a loop that traces every further segment exactly once.
+     * @param payload The closest hit of the ray (eyePos, dir).
+     * @param rays If given, the extension and shadow rays traced for the path are added to it.
+     */
+    virtual cv::Vec3f pathTracing(const cv::Vec3f &eyePos, const cv::Vec3f &dir, const std::optional<HitPayload> &payload, uint64_t *rays = nullptr) const;
+
     virtual cv::Vec3f getRay(int x, int y) const;
 
     const cv::Vec3f &getBgColor() const { return m_bgColor; }
@@ -69,25 +113,48 @@ public:
     int getMaxDepth() const { return m_maxDepth; }
     const cv::Vec3f &getEyePos() const { return m_camera.eyePos; }
     float getRussianRoulette() const { return m_russianRoulette; }
+    bool getMIS() const { return m_mis; }
+    void setMIS(bool mis) { m_mis = mis; }
 
 protected:
-    std::pair<HitPayload, float> sampleLight() const;
-
-    virtual cv::Vec3f calDirectLight(const cv::Vec3f &lightPos, const cv::Vec3f &lightDir, const cv::Vec3f &lightNormal, float lightPdf, const cv::Vec3f &emission, const cv::Vec3f &dir, const cv::Vec3f &hitNormal, float dis) const;
-
-    virtual cv::Vec3f calIndirectLight(const std::shared_ptr<const Object> &hitObj, const cv::Vec3f &hitNormal, const cv::Vec3f &hitPoint, const cv::Vec3f &dir, bool addDirectLight = false) const;
+    /**
+     * @brief Light arriving at hitPoint from a sampled light point, weighted against BSDF sampling if mis is set
+     * @param lightPdf The pdf of the light sample with respect to solid angle
+     */
+    virtual cv::Vec3f calDirectLight(const HitPayload &light, float lightPdf, const Object *hitObj, const cv::Vec2f &st, const cv::Vec3f &hitPoint, const cv::Vec3f &dir, const cv::Vec3f &hitNormal, bool mis) const;
 };
 
 class BVHScene : public Scene
 {
 private:
     std::shared_ptr<BVH> m_bvh;
+    // optional wide hierarchies collapsed from m_bvh, used for traversal when present
+    std::shared_ptr<BVH4> m_bvh4;
+    std::shared_ptr<BVH8> m_bvh8;
+    std::string m_bvhCachePath;
+
+    void buildWideBVH(const BVHBuildConfig &config);
 
     virtual std::optional<HitPayload> trace(const Ray &ray) const override;
+    virtual void trace(const RayPacket &packet, std::optional<HitPayload> *hits) const override;
+    virtual bool visible(const cv::Vec3f &a, const cv::Vec3f &b) const override;
 
 public:
     BVHScene(const Camera &camera, const cv::Vec3f &bgColor);
-    void buildBVH();
+    /**
+     * @brief Build the BVH, or load it from the cache file if one is set and still matches the scene.
+     */
+    void buildBVH(const BVHBuildConfig &config = BVHBuildConfig());
+
+    /**
+     * @brief Update the BVH after objects moved, e.g. between the frames of an animation.
+     *        Refits the bounds, and rebuilds only when the refitted tree has degraded too much.
+     */
+    void updateBVH();
+
+    void setBVHCachePath(const std::string &path) { m_bvhCachePath = path; }
+
+    const std::shared_ptr<BVH> &getBVH() const { return m_bvh; }
 
     friend void testSphereBVH();
 };
@@ -1,4 +1,8 @@
 #include "AABB.h"
+#include "common/utils.h"
+#if ZOE_X86
+#include <immintrin.h>
+#endif
 
 AABB::AABB()
 {
@@ -15,6 +19,52 @@ AABB::AABB(const cv::Vec3f &min, const cv::Vec3f &max) :
 
 }
 
+int AABB::intersect(const RayPacket &packet, int activeMask) const
+{
+    int mask = 0;
+#if ZOE_X86
+    // four lanes per step, the near plane of each lane is picked by its direction sign
+    __m128 exitScale = _mm_set1_ps(slabExitScale);
+    for (int base = 0; base < packet.size; base += 4)
+    {
+        __m128 enter = _mm_load_ps(packet.tMin + base);
+        __m128 exit = _mm_load_ps(packet.tMax + base);
+        __m128i octant = _mm_load_si128(reinterpret_cast<const __m128i *>(packet.octant + base));
+        for (int a = 0; a < 3; a++)
+        {
+            __m128i bit = _mm_set1_epi32(1 << a);
+            __m128 neg = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(octant, bit), bit));
+            __m128 lo = _mm_set1_ps(m_min[a]);
+            __m128 hi = _mm_set1_ps(m_max[a]);
+            __m128 nearPlane = _mm_or_ps(_mm_and_ps(neg, hi), _mm_andnot_ps(neg, lo));
+            __m128 farPlane = _mm_or_ps(_mm_and_ps(neg, lo), _mm_andnot_ps(neg, hi));
+            __m128 o = _mm_load_ps(packet.orig[a] + base);
+            __m128 inv = _mm_load_ps(packet.invDir[a] + base);
+            // _mm_max_ps / _mm_min_ps return the second operand on NaN, so the running interval is kept
+            enter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, o), inv), enter);
+            exit = _mm_min_ps(_mm_mul_ps(_mm_mul_ps(_mm_sub_ps(farPlane, o), inv), exitScale), exit);
+        }
+        mask |= _mm_movemask_ps(_mm_cmple_ps(enter, exit)) << base;
+    }
+#else
+    for (int i = 0; i < packet.size; i++)
+    {
+        float enter = packet.tMin[i];
+        float exit = packet.tMax[i];
+        for (int a = 0; a < 3; a++)
+        {
+            bool neg = packet.octant[i] >> a & 1;
+            float tNear = ((neg ? m_max[a] : m_min[a]) - packet.orig[a][i]) * packet.invDir[a][i];
+            float tFar = ((neg ? m_min[a] : m_max[a]) - packet.orig[a][i]) * packet.invDir[a][i] * slabExitScale;
+            enter = tNear > enter ? tNear : enter;
+            exit = tFar < exit ? tFar : exit;
+        }
+        mask |= (enter <= exit) << i;
+    }
+#endif
+    return mask & activeMask;
+}
+
 int AABB::getLargestAxis() const
 {
     cv::Vec3f diag = getDiagonal();
@@ -26,26 +76,34 @@ int AABB::getLargestAxis() const
         return 2;
 }
 
-bool AABB::intersect(const Ray &ray) const
+float AABB::getSurfaceArea() const
 {
-    const cv::Vec3f &orig = ray.getOrig();
-    const cv::Vec3f &dir = ray.getDir();
-    float enter = std::numeric_limits<float>::lowest();
-    float exit = std::numeric_limits<float>::max();
-    std::vector<bool> neg {
-        dir[0] > 0,
-        dir[1] > 0,
-        dir[2] > 0
-    };
-
-    for (int i = 0; i < 3; i++)
+    if (isEmpty())
     {
-        float t1 = (m_min[i] - orig[i]) / dir[i];
-        float t2 = (m_max[i] - orig[i]) / dir[i];
-        enter = std::max(enter, neg[i] ? t1 : t2);
-        exit = std::min(exit, neg[i] ? t2 : t1);
+        return 0;
     }
-    return enter <= exit && exit >= 0;
+    cv::Vec3f diag = getDiagonal();
+    return 2 * (diag[0] * diag[1] + diag[0] * diag[2] + diag[1] * diag[2]);
+}
+
+bool AABB::isEmpty() const
+{
+    return m_min[0] > m_max[0] || m_min[1] > m_max[1] || m_min[2] > m_max[2];
+}
+
+AABB AABB::intersection(const AABB &other) const
+{
+    cv::Vec3f min = cv::Vec3f(
+        std::max(m_min[0], other.m_min[0]),
+        std::max(m_min[1], other.m_min[1]),
+        std::max(m_min[2], other.m_min[2])
+    );
+    cv::Vec3f max = cv::Vec3f(
+        std::min(m_max[0], other.m_max[0]),
+        std::min(m_max[1], other.m_max[1]),
+        std::min(m_max[2], other.m_max[2])
+    );
+    return AABB(min, max);
 }
 
 AABB AABB::operator+(const AABB &other) const
@@ -3,6 +3,7 @@
 
 #include <opencv2/opencv.hpp>
 #include "common/Ray.h"
+#include "common/RayPacket.h"
 
 class AABB
 {
@@ -11,14 +12,59 @@ private:
     cv::Vec3f m_max;
 
 public:
+    // 1 + 2 * gamma(3): pads the slab exit so that rounding never rejects a box the ray touches
+    static constexpr float slabExitScale = 1 + 3 * std::numeric_limits<float>::epsilon();
+
     AABB();
     AABB(const cv::Vec3f &min, const cv::Vec3f &max);
 
+    const cv::Vec3f &getMin() const { return m_min; }
+    const cv::Vec3f &getMax() const { return m_max; }
     cv::Vec3f getCentroid() const { return (m_min + m_max) / 2; }
     cv::Vec3f getDiagonal() const { return m_max - m_min; }
     int getLargestAxis() const;
+    float getSurfaceArea() const;
+    bool isEmpty() const;
+
+    AABB intersection(const AABB &other) const;
+
+    /**
+     * @brief Slab test against the ray's [tMin, tMax], no allocation, division or branch on the direction.
+     *        A NaN slab (origin on the plane of a zero direction component) leaves the interval unchanged.
+     * @param tEnter tExit The overlap of the ray and the box, valid when the test passes
+     */
+    bool intersect(const Ray &ray, float &tEnter, float &tExit) const
+    {
+        const cv::Vec3f &orig = ray.getOrig();
+        const cv::Vec3f &invDir = ray.getInvDir();
+        const int *dirIsNeg = ray.getDirIsNeg();
+        const cv::Vec3f *bounds[2] = { &m_min, &m_max };
+        float enter = ray.getTMin();
+        float exit = ray.getTMax();
+        for (int i = 0; i < 3; i++)
+        {
+            float tNear = ((*bounds[dirIsNeg[i]])[i] - orig[i]) * invDir[i];
+            float tFar = ((*bounds[1 - dirIsNeg[i]])[i] - orig[i]) * invDir[i] * slabExitScale;
+            // comparisons with NaN are false, so the running values are kept
+            enter = tNear > enter ? tNear : enter;
+            exit = tFar < exit ? tFar : exit;
+        }
+        tEnter = enter;
+        tExit = exit;
+        return enter <= exit;
+    }
+
+    bool intersect(const Ray &ray) const
+    {
+        float tEnter, tExit;
+        return intersect(ray, tEnter, tExit);
+    }
 
-    bool intersect(const Ray &ray) const;
+    /**
+     * @brief The same slab test for every lane of a ray packet
+     * @return The mask of active lanes that overlap the box
+     */
+    int intersect(const RayPacket &packet, int activeMask) const;
 
     AABB operator+(const AABB &other) const;
     AABB operator+(const cv::Vec3f &vec) const;
@@ -1,86 +1,1493 @@
-#include <numeric>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "BVH.h"
 #include "common/utils.h"
+#include "common/TraversalStats.h"
 #include "objects/Object.h"
 
-BVH::BVH(const std::vector<std::shared_ptr<Object>> &objects)
+namespace {
+
+// spreads the low 21 bits of x so that two zero bits separate each of them
+uint64_t expandBits(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+// bit 3k + 2 of the code belongs to x, 3k + 1 to y and 3k to z
+uint64_t encodeMorton(uint64_t x, uint64_t y, uint64_t z)
+{
+    return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+// bits of each coordinate in the 30 or 63 bit Morton codes
+int mortonBitsPerAxis(int mortonBits)
+{
+    return mortonBits >= 63 ? 21 : 10;
+}
+
+/**
+ * @brief Stable LSD radix sort on the code member, 8 bits per pass.
+ *        Every pass builds per-chunk histograms in parallel, so that each chunk
+ *        can scatter to its own precomputed offsets.
+ */
+template <typename T>
+void radixSort(std::vector<T> &values, int bits)
+{
+    constexpr int bitsPerPass = 8;
+    constexpr int nBuckets = 1 << bitsPerPass;
+    const int n = values.size();
+    const int nChunks = std::clamp(n / 16384, 1, 64);
+    const int chunkSize = (n + nChunks - 1) / nChunks;
+    std::vector<T> temp(n);
+    std::vector<int> offsets(nChunks * nBuckets);
+    for (int lowBit = 0; lowBit < bits; lowBit += bitsPerPass)
+    {
+        std::fill(offsets.begin(), offsets.end(), 0);
+#if ENABLE_OPENMP
+        #pragma omp parallel for
+#endif
+        for (int c = 0; c < nChunks; c++)
+        {
+            int *count = &offsets[c * nBuckets];
+            for (int i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); i++)
+            {
+                count[(values[i].code >> lowBit) & (nBuckets - 1)]++;
+            }
+        }
+
+        // bucket-major exclusive scan keeps the chunks of one bucket in input order
+        int sum = 0;
+        for (int b = 0; b < nBuckets; b++)
+        {
+            for (int c = 0; c < nChunks; c++)
+            {
+                int count = offsets[c * nBuckets + b];
+                offsets[c * nBuckets + b] = sum;
+                sum += count;
+            }
+        }
+
+#if ENABLE_OPENMP
+        #pragma omp parallel for
+#endif
+        for (int c = 0; c < nChunks; c++)
+        {
+            int *offset = &offsets[c * nBuckets];
+            for (int i = c * chunkSize; i < std::min(n, (c + 1) * chunkSize); i++)
+            {
+                temp[offset[(values[i].code >> lowBit) & (nBuckets - 1)]++] = values[i];
+            }
+        }
+        values.swap(temp);
+    }
+}
+
+}
+
+BVH::BVH(const std::vector<std::shared_ptr<Object>> &objects, const BVHBuildConfig &config) :
+    m_config(config)
 {
     m_objects = objects;
-    m_root = init();
+    m_hash = computeHash(objects, config);
+    init();
 }
 
-std::shared_ptr<BVH::BVHNode> BVH::init()
+void BVH::init()
 {
-    return init(m_objects.begin(), m_objects.end());
+    using clock = std::chrono::high_resolution_clock;
+    m_nodes.clear();
+    m_prims.clear();
+    m_buildTimes = BuildTimes();
+    if (m_objects.empty())
+    {
+        return;
+    }
+
+    auto t0 = clock::now();
+    // objects made of several primitives, e.g. meshes, are split into their faces
+    std::vector<PrimitiveRef> prims;
+    for (const auto &object : m_objects)
+    {
+        for (int i = 0; i < object->getPrimitiveCount(); i++)
+        {
+            prims.push_back({ object.get(), i });
+        }
+    }
+    if (prims.empty())
+    {
+        return;
+    }
+
+    std::vector<BVHPrimitiveInfo> primInfo(prims.size());
+#if ENABLE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (size_t i = 0; i < prims.size(); i++)
+    {
+        AABB aabb = prims[i].object->getPrimitiveAABB(prims[i].index);
+        primInfo[i] = { aabb, aabb.getCentroid(), static_cast<int>(i) };
+    }
+    m_prims.swap(prims);
+
+    auto t1 = clock::now();
+    std::atomic<int> totalNodes = 0;
+    std::unique_ptr<BVHBuildNode> root;
+    if (m_config.splitMethod == BVHBuildConfig::SplitMethod::SBVH)
+    {
+        SBVHState state;
+        state.maxDuplicates = static_cast<int>(m_config.sbvhDuplicationBudget * primInfo.size());
+        AABB bound;
+        for (const BVHPrimitiveInfo &info : primInfo)
+        {
+            bound = bound + info.aabb;
+        }
+        state.rootArea = bound.getSurfaceArea();
+        state.orderedIndices.reserve(primInfo.size() + state.maxDuplicates);
+#if ENABLE_OPENMP
+        #pragma omp parallel
+        #pragma omp single
+#endif
+        root = recursiveBuildSBVH(primInfo, 0, state);
+
+        // leaves were numbered as they were created, an object may appear in several of them
+        m_primIndices.swap(state.orderedIndices);
+        totalNodes = state.totalNodes.load();
+    }
+    else
+    {
+        bool useMorton = m_config.splitMethod == BVHBuildConfig::SplitMethod::LBVH 
+            || m_config.splitMethod == BVHBuildConfig::SplitMethod::HLBVH;
+        // the codes are computed and sorted by parallel loops, which would get a team of one inside the task region
+        std::vector<MortonPrimitive> morton;
+        if (useMorton)
+        {
+            morton = sortMorton(primInfo);
+        }
+#if ENABLE_OPENMP
+        #pragma omp parallel
+        #pragma omp single
+#endif
+        root = useMorton ? buildMorton(primInfo, morton, totalNodes) : recursiveBuild(primInfo, 0, primInfo.size(), totalNodes);
+
+        // leaves refer to contiguous ranges of primInfo
+        m_primIndices.resize(primInfo.size());
+        for (size_t i = 0; i < primInfo.size(); i++)
+        {
+            m_primIndices[i] = primInfo[i].index;
+        }
+    }
+
+    auto t2 = clock::now();
+    // flatten renumbers the leaves in depth-first order, then the primitives are reordered to match
+    std::vector<int> primIndices;
+    primIndices.reserve(m_primIndices.size());
+    m_nodes.reserve(totalNodes);
+    flatten(root.get(), 0, primIndices);
+    m_primIndices.swap(primIndices);
+    std::vector<PrimitiveRef> orderedPrims(m_primIndices.size());
+    for (size_t i = 0; i < m_primIndices.size(); i++)
+    {
+        orderedPrims[i] = m_prims[m_primIndices[i]];
+    }
+    m_prims.swap(orderedPrims);
+    buildTriangleBlocks();
+
+    auto t3 = clock::now();
+    m_buildSAHCost = getSAHCost();
+    m_buildTimes.bounds = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    m_buildTimes.build = std::chrono::duration<double, std::milli>(t2 - t1).count();
+    m_buildTimes.flatten = std::chrono::duration<double, std::milli>(t3 - t2).count();
 }
 
-std::shared_ptr<BVH::BVHNode> BVH::init(obj_iter begin, obj_iter end)
+std::unique_ptr<BVH::BVHBuildNode> BVH::recursiveBuild(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end, std::atomic<int> &totalNodes) const
 {
-    std::shared_ptr<BVH::BVHNode> node = std::make_shared<BVH::BVHNode>();
-    AABB bound = std::accumulate(begin, end, AABB{}, [](const AABB &acc, const auto obj) { 
-        return acc + obj->getAABB(); 
-    });
+    totalNodes++;
+    std::unique_ptr<BVHBuildNode> node = std::make_unique<BVHBuildNode>();
+    AABB bound;
+    AABB centroidBound;
+    for (int i = start; i < end; i++)
+    {
+        bound = bound + primInfo[i].aabb;
+        centroidBound = centroidBound + primInfo[i].centroid;
+    }
+    node->aabb = bound;
+
+    // leaves own the contiguous range [start, end) of primInfo
+    const int nPrimitives = end - start;
+    auto makeLeaf = [&]() {
+        node->firstPrimOffset = start;
+        node->nPrimitives = nPrimitives;
+        return std::move(node);
+    };
+    if (nPrimitives == 1)
+    {
+        return makeLeaf();
+    }
+
+    int axis = centroidBound.getLargestAxis();
+    int mid = start + nPrimitives / 2;
+    switch (m_config.splitMethod)
+    {
+        case BVHBuildConfig::SplitMethod::MEDIAN:
+        {
+            if (nPrimitives <= m_config.maxLeafSize)
+            {
+                return makeLeaf();
+            }
+            mid = splitMedian(primInfo, start, end, axis);
+            break;
+        }
+        case BVHBuildConfig::SplitMethod::SAH:
+        default:
+        {
+            std::optional<SplitCandidate> split = findObjectSplit(primInfo, start, end, bound, centroidBound);
+            if (nPrimitives <= m_config.maxLeafSize && (!split.has_value() || split->cost >= leafCost(nPrimitives)))
+            {
+                return makeLeaf();
+            }
+            if (split.has_value())
+            {
+                axis = split->axis;
+                mid = partitionObjects(primInfo, start, end, centroidBound, split.value());
+            }
+            else
+            {
+                mid = splitMedian(primInfo, start, end, axis);
+            }
+            break;
+        }
+    }
+    node->axis = axis;
+
+    // both halves work on disjoint ranges of primInfo, so the first one can run as a task
+    BVHBuildNode *parent = node.get();
+#if ENABLE_OPENMP
+    #pragma omp task shared(primInfo, totalNodes) firstprivate(parent, start, mid) if (mid - start >= m_config.parallelCutoff)
+#endif
+    parent->children[0] = recursiveBuild(primInfo, start, mid, totalNodes);
+    parent->children[1] = recursiveBuild(primInfo, mid, end, totalNodes);
+#if ENABLE_OPENMP
+    #pragma omp taskwait
+#endif
+    return node;
+}
+
+std::vector<BVH::MortonPrimitive> BVH::sortMorton(std::vector<BVHPrimitiveInfo> &primInfo) const
+{
+    const int bitsPerAxis = mortonBitsPerAxis(m_config.mortonBits);
+    const int totalBits = 3 * bitsPerAxis;
+    const float scale = static_cast<float>(1 << bitsPerAxis) - 1;
+    AABB centroidBound;
+    for (const BVHPrimitiveInfo &info : primInfo)
+    {
+        centroidBound = centroidBound + info.centroid;
+    }
+    cv::Vec3f invExtent;
+    for (int dim = 0; dim < 3; dim++)
+    {
+        float extent = centroidBound.getDiagonal()[dim];
+        invExtent[dim] = extent > 0 ? 1.0f / extent : 0.0f;
+    }
 
-    if (end - begin == 1)
+    const int n = primInfo.size();
+    std::vector<MortonPrimitive> morton(n);
+#if ENABLE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < n; i++)
     {
-        node->obj = *begin;
-        node->aabb = (*begin)->getAABB();
+        cv::Vec3f offset = (primInfo[i].centroid - centroidBound.getMin()).mul(invExtent) * scale;
+        morton[i] = { encodeMorton(offset[0], offset[1], offset[2]), i };
+    }
+    radixSort(morton, totalBits);
+
+    // leaves refer to contiguous ranges of primInfo, so it follows the sorted order
+    std::vector<BVHPrimitiveInfo> sorted(n);
+#if ENABLE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int i = 0; i < n; i++)
+    {
+        sorted[i] = primInfo[morton[i].index];
+    }
+    primInfo.swap(sorted);
+    return morton;
+}
+
+std::unique_ptr<BVH::BVHBuildNode> BVH::buildMorton(const std::vector<BVHPrimitiveInfo> &primInfo, const std::vector<MortonPrimitive> &morton, std::atomic<int> &totalNodes) const
+{
+    const int totalBits = 3 * mortonBitsPerAxis(m_config.mortonBits);
+    const int n = primInfo.size();
+    if (m_config.splitMethod == BVHBuildConfig::SplitMethod::LBVH)
+    {
+        return emitLBVH(primInfo, morton, 0, n, totalBits - 1, totalNodes);
+    }
+
+    // HLBVH: one treelet per distinct prefix of the codes
+    const int prefixShift = totalBits - treeletBits;
+    std::vector<std::pair<int, int>> ranges;
+    for (int start = 0, end = 1; end <= n; end++)
+    {
+        if (end == n || (morton[start].code >> prefixShift) != (morton[end].code >> prefixShift))
+        {
+            ranges.emplace_back(start, end);
+            start = end;
+        }
+    }
+
+    std::vector<std::unique_ptr<BVHBuildNode>> treelets(ranges.size());
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+#if ENABLE_OPENMP
+        #pragma omp task shared(primInfo, morton, ranges, treelets, totalNodes) firstprivate(i, prefixShift)
+#endif
+        treelets[i] = emitLBVH(primInfo, morton, ranges[i].first, ranges[i].second, prefixShift - 1, totalNodes);
+    }
+#if ENABLE_OPENMP
+    #pragma omp taskwait
+#endif
+
+    std::vector<BVHPrimitiveInfo> rootInfo(treelets.size());
+    for (size_t i = 0; i < treelets.size(); i++)
+    {
+        rootInfo[i] = { treelets[i]->aabb, treelets[i]->aabb.getCentroid(), static_cast<int>(i) };
+    }
+    return buildUpperSAH(rootInfo, 0, rootInfo.size(), treelets, totalNodes);
+}
+
+std::unique_ptr<BVH::BVHBuildNode> BVH::emitLBVH(const std::vector<BVHPrimitiveInfo> &primInfo, const std::vector<MortonPrimitive> &morton, int start, int end, int bitIndex, std::atomic<int> &totalNodes) const
+{
+    totalNodes++;
+    std::unique_ptr<BVHBuildNode> node = std::make_unique<BVHBuildNode>();
+    if (end - start <= std::max(1, m_config.maxLeafSize))
+    {
+        AABB aabb;
+        for (int i = start; i < end; i++)
+        {
+            aabb = aabb + primInfo[i].aabb;
+        }
+        node->aabb = aabb;
+        node->firstPrimOffset = start;
+        node->nPrimitives = end - start;
         return node;
     }
-    else
+
+    // the codes are sorted, so the range only differs below the first bit its ends disagree on
+    while (bitIndex >= 0 && ((morton[start].code ^ morton[end - 1].code) >> bitIndex & 1) == 0)
     {
-        AABB centroidBound = std::accumulate(begin, end, AABB{}, [](const AABB &acc, const auto obj) { 
-            return acc + obj->getAABB().getCentroid(); 
-        });
+        bitIndex--;
+    }
+    int mid = start + (end - start) / 2;
+    if (bitIndex >= 0)
+    {
+        uint64_t bit = uint64_t(1) << bitIndex;
+        mid = std::partition_point(morton.begin() + start, morton.begin() + end, [bit](const MortonPrimitive &p) {
+            return (p.code & bit) == 0;
+        }) - morton.begin();
+        node->axis = 2 - bitIndex % 3;
+    }
 
-        int axis = centroidBound.getLargestAxis();
-        std::sort(begin, end, [axis](const auto &a, const auto &b) {
-            return a->getAABB().getCentroid()[axis] < b->getAABB().getCentroid()[axis];
-        });
+    BVHBuildNode *parent = node.get();
+#if ENABLE_OPENMP
+    #pragma omp task shared(primInfo, morton, totalNodes) firstprivate(parent, start, mid, bitIndex) if (mid - start >= m_config.parallelCutoff)
+#endif
+    parent->children[0] = emitLBVH(primInfo, morton, start, mid, bitIndex - 1, totalNodes);
+    parent->children[1] = emitLBVH(primInfo, morton, mid, end, bitIndex - 1, totalNodes);
+#if ENABLE_OPENMP
+    #pragma omp taskwait
+#endif
+    node->aabb = node->children[0]->aabb + node->children[1]->aabb;
+    return node;
+}
 
-        obj_iter middle = begin + (end - begin) / 2;
-        node->left = init(begin, middle);
-        node->right = init(middle, end);
-        node->aabb = node->left->aabb + node->right->aabb;
+std::unique_ptr<BVH::BVHBuildNode> BVH::buildUpperSAH(std::vector<BVHPrimitiveInfo> &rootInfo, int start, int end, std::vector<std::unique_ptr<BVHBuildNode>> &treelets, std::atomic<int> &totalNodes) const
+{
+    if (end - start == 1)
+    {
+        return std::move(treelets[rootInfo[start].index]);
     }
+
+    totalNodes++;
+    std::unique_ptr<BVHBuildNode> node = std::make_unique<BVHBuildNode>();
+    AABB bound;
+    AABB centroidBound;
+    for (int i = start; i < end; i++)
+    {
+        bound = bound + rootInfo[i].aabb;
+        centroidBound = centroidBound + rootInfo[i].centroid;
+    }
+    node->aabb = bound;
+
+    int mid;
+    std::optional<SplitCandidate> split = findObjectSplit(rootInfo, start, end, bound, centroidBound);
+    if (split.has_value())
+    {
+        node->axis = split->axis;
+        mid = partitionObjects(rootInfo, start, end, centroidBound, split.value());
+    }
+    else
+    {
+        node->axis = centroidBound.getLargestAxis();
+        mid = splitMedian(rootInfo, start, end, node->axis);
+    }
+    node->children[0] = buildUpperSAH(rootInfo, start, mid, treelets, totalNodes);
+    node->children[1] = buildUpperSAH(rootInfo, mid, end, treelets, totalNodes);
     return node;
 }
 
-std::optional<HitPayload> BVH::intersect(const Ray &ray)
+int BVH::flatten(const BVHBuildNode *node, int depth, std::vector<int> &primIndices)
+{
+    int nodeIndex = m_nodes.size();
+    m_nodes.emplace_back();
+    // the traversal stacks hold maxTraversalDepth entries, so a subtree that would go deeper becomes one leaf
+    if (node->nPrimitives > 0 || depth == maxTraversalDepth - 1)
+    {
+        int offset = primIndices.size();
+        collectPrimitives(node, primIndices);
+        int nPrimitives = primIndices.size() - offset;
+        if (nPrimitives > UINT16_MAX)
+        {
+            throw std::runtime_error("BVH::flatten: too many primitives below the depth limit");
+        }
+        LinearBVHNode &linearNode = m_nodes[nodeIndex];
+        linearNode.aabb = node->aabb;
+        linearNode.primitivesOffset = offset;
+        linearNode.nPrimitives = nPrimitives;
+        return nodeIndex;
+    }
+
+    // the first child is emitted right after its parent
+    flatten(node->children[0].get(), depth + 1, primIndices);
+    int secondChild = flatten(node->children[1].get(), depth + 1, primIndices);
+
+    // m_nodes may have been reallocated by the recursive calls
+    LinearBVHNode &linearNode = m_nodes[nodeIndex];
+    linearNode.aabb = node->aabb;
+    linearNode.secondChildOffset = secondChild;
+    linearNode.nPrimitives = 0;
+    linearNode.axis = node->axis;
+    return nodeIndex;
+}
+
+void BVH::collectPrimitives(const BVHBuildNode *node, std::vector<int> &primIndices) const
+{
+    if (node->nPrimitives > 0)
+    {
+        for (int i = 0; i < node->nPrimitives; i++)
+        {
+            primIndices.push_back(m_primIndices[node->firstPrimOffset + i]);
+        }
+        return;
+    }
+    collectPrimitives(node->children[0].get(), primIndices);
+    collectPrimitives(node->children[1].get(), primIndices);
+}
+
+int BVH::splitMedian(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end, int axis) const
+{
+    int mid = start + (end - start) / 2;
+    std::nth_element(primInfo.begin() + start, primInfo.begin() + mid, primInfo.begin() + end, [axis](const BVHPrimitiveInfo &a, const BVHPrimitiveInfo &b) {
+        return a.centroid[axis] < b.centroid[axis];
+    });
+    return mid;
+}
+
+int BVH::bucketIndex(float value, float min, float extent) const
+{
+    float offset = (value - min) / extent;
+    return std::clamp(static_cast<int>(offset * m_config.nBuckets), 0, m_config.nBuckets - 1);
+}
+
+float BVH::leafCost(int nPrimitives) const
 {
-    if (!m_root)
+#if !WATERTIGHT_TRIANGLE_TEST
+    if (m_config.triangleBlocks)
+    {
+        return (nPrimitives + TriangleBlock::width - 1) / TriangleBlock::width;
+    }
+#endif
+    return nPrimitives;
+}
+
+std::optional<BVH::SplitCandidate> BVH::findObjectSplit(const std::vector<BVHPrimitiveInfo> &primInfo, int start, int end, const AABB &bound, const AABB &centroidBound) const
+{
+    struct Bucket
+    {
+        int count = 0;
+        AABB aabb;
+    };
+
+    const int nBuckets = m_config.nBuckets;
+    const float area = bound.getSurfaceArea();
+    if (area <= 0)
     {
         return std::nullopt;
     }
-    return intersect(m_root, ray);
+
+    std::optional<SplitCandidate> best;
+    std::vector<Bucket> buckets(nBuckets);
+    std::vector<AABB> rightAabb(nBuckets);
+    std::vector<int> rightCount(nBuckets);
+    for (int dim = 0; dim < 3; dim++)
+    {
+        float min = centroidBound.getMin()[dim];
+        float extent = centroidBound.getDiagonal()[dim];
+        if (extent <= 0)
+        {
+            continue;
+        }
+
+        std::fill(buckets.begin(), buckets.end(), Bucket());
+        for (int i = start; i < end; i++)
+        {
+            Bucket &bucket = buckets[bucketIndex(primInfo[i].centroid[dim], min, extent)];
+            bucket.count++;
+            bucket.aabb = bucket.aabb + primInfo[i].aabb;
+        }
+
+        // sweep from the right first so that every split is evaluated in O(1)
+        AABB acc;
+        int count = 0;
+        for (int i = nBuckets - 1; i > 0; i--)
+        {
+            acc = acc + buckets[i].aabb;
+            count += buckets[i].count;
+            rightAabb[i] = acc;
+            rightCount[i] = count;
+        }
+
+        acc = AABB();
+        count = 0;
+        for (int i = 0; i < nBuckets - 1; i++)
+        {
+            acc = acc + buckets[i].aabb;
+            count += buckets[i].count;
+            if (count == 0 || rightCount[i + 1] == 0)
+            {
+                continue;
+            }
+            float cost = m_config.traversalCostRatio 
+                + (count * acc.getSurfaceArea() + rightCount[i + 1] * rightAabb[i + 1].getSurfaceArea()) / area;
+            if (!best.has_value() || cost < best->cost)
+            {
+                best = SplitCandidate { cost, dim, i, acc, rightAabb[i + 1] };
+            }
+        }
+    }
+    return best;
 }
 
-std::optional<HitPayload> BVH::intersect(const std::shared_ptr<BVHNode> &node, const Ray &ray)
+int BVH::partitionObjects(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end, const AABB &centroidBound, const SplitCandidate &split) const
 {
-    if (!node || !node->aabb.intersect(ray))
+    float min = centroidBound.getMin()[split.axis];
+    float extent = centroidBound.getDiagonal()[split.axis];
+    auto mid = std::partition(primInfo.begin() + start, primInfo.begin() + end, [&](const BVHPrimitiveInfo &info) {
+        return bucketIndex(info.centroid[split.axis], min, extent) <= split.bucket;
+    });
+    return mid - primInfo.begin();
+}
+
+std::optional<BVH::SplitCandidate> BVH::findSpatialSplit(const std::vector<BVHPrimitiveInfo> &refs, const AABB &bound) const
+{
+    struct Bin
+    {
+        int entries = 0;
+        int exits = 0;
+        AABB aabb;
+    };
+
+    const int nBuckets = m_config.nBuckets;
+    const int n = refs.size();
+    const float area = bound.getSurfaceArea();
+    if (area <= 0)
     {
         return std::nullopt;
     }
-    if (node->left == nullptr && node->right == nullptr)
+
+    std::optional<SplitCandidate> best;
+    std::vector<Bin> bins(nBuckets);
+    std::vector<AABB> rightAabb(nBuckets);
+    std::vector<int> rightCount(nBuckets);
+    for (int dim = 0; dim < 3; dim++)
+    {
+        float min = bound.getMin()[dim];
+        float extent = bound.getDiagonal()[dim];
+        if (extent <= 0)
+        {
+            continue;
+        }
+
+        // bins are uniform over the node bound, each reference is chopped into the bins it overlaps
+        std::fill(bins.begin(), bins.end(), Bin());
+        for (const BVHPrimitiveInfo &ref : refs)
+        {
+            int first = bucketIndex(ref.aabb.getMin()[dim], min, extent);
+            int last = bucketIndex(ref.aabb.getMax()[dim], min, extent);
+            AABB rest = ref.aabb;
+            for (int i = first; i < last; i++)
+            {
+                float plane = min + extent * (i + 1) / nBuckets;
+                AABB left, right;
+                m_prims[ref.index].object->splitPrimitiveAABB(m_prims[ref.index].index, dim, plane, rest, left, right);
+                bins[i].aabb = bins[i].aabb + left;
+                rest = right;
+            }
+            bins[last].aabb = bins[last].aabb + rest;
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+
+        AABB acc;
+        int count = 0;
+        for (int i = nBuckets - 1; i > 0; i--)
+        {
+            acc = acc + bins[i].aabb;
+            count += bins[i].exits;
+            rightAabb[i] = acc;
+            rightCount[i] = count;
+        }
+
+        acc = AABB();
+        count = 0;
+        for (int i = 0; i < nBuckets - 1; i++)
+        {
+            acc = acc + bins[i].aabb;
+            count += bins[i].entries;
+            // a split that keeps every reference on one side makes no progress
+            if (count == 0 || rightCount[i + 1] == 0 || (count == n && rightCount[i + 1] == n))
+            {
+                continue;
+            }
+            float cost = m_config.traversalCostRatio 
+                + (count * acc.getSurfaceArea() + rightCount[i + 1] * rightAabb[i + 1].getSurfaceArea()) / area;
+            if (!best.has_value() || cost < best->cost)
+            {
+                best = SplitCandidate { cost, dim, i, acc, rightAabb[i + 1] };
+            }
+        }
+    }
+    return best;
+}
+
+bool BVH::partitionSpatial(const std::vector<BVHPrimitiveInfo> &refs, const AABB &bound, const SplitCandidate &split, SBVHState &state, std::vector<BVHPrimitiveInfo> &left, std::vector<BVHPrimitiveInfo> &right) const
+{
+    const int axis = split.axis;
+    const float plane = bound.getMin()[axis] + bound.getDiagonal()[axis] * (split.bucket + 1) / m_config.nBuckets;
+    int duplicates = 0;
+    for (const BVHPrimitiveInfo &ref : refs)
+    {
+        if (ref.aabb.getMax()[axis] <= plane)
+        {
+            left.push_back(ref);
+            continue;
+        }
+        if (ref.aabb.getMin()[axis] >= plane)
+        {
+            right.push_back(ref);
+            continue;
+        }
+
+        AABB leftAabb, rightAabb;
+        m_prims[ref.index].object->splitPrimitiveAABB(m_prims[ref.index].index, axis, plane, ref.aabb, leftAabb, rightAabb);
+        if (!leftAabb.isEmpty())
+        {
+            left.push_back({ leftAabb, leftAabb.getCentroid(), ref.index });
+        }
+        if (!rightAabb.isEmpty())
+        {
+            right.push_back({ rightAabb, rightAabb.getCentroid(), ref.index });
+        }
+        if (!leftAabb.isEmpty() && !rightAabb.isEmpty())
+        {
+            duplicates++;
+        }
+    }
+
+    // reserve the duplicates against the shared budget, other tasks may be doing the same
+    bool valid = !left.empty() && !right.empty();
+    if (!valid || state.duplicates.fetch_add(duplicates) + duplicates > state.maxDuplicates)
+    {
+        if (valid)
+        {
+            state.duplicates -= duplicates;
+        }
+        left.clear();
+        right.clear();
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<BVH::BVHBuildNode> BVH::recursiveBuildSBVH(std::vector<BVHPrimitiveInfo> &refs, int depth, SBVHState &state) const
+{
+    state.totalNodes++;
+    std::unique_ptr<BVHBuildNode> node = std::make_unique<BVHBuildNode>();
+    AABB bound;
+    AABB centroidBound;
+    for (const BVHPrimitiveInfo &ref : refs)
     {
-        return node->obj->intersect(ray);
+        bound = bound + ref.aabb;
+        centroidBound = centroidBound + ref.centroid;
     }
-    std::optional<HitPayload> left = intersect(node->left, ray);
-    std::optional<HitPayload> right = intersect(node->right, ray);
-    if (left && right)
+    node->aabb = bound;
+
+    const int nPrimitives = refs.size();
+    auto makeLeaf = [&]() {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        node->firstPrimOffset = state.orderedIndices.size();
+        node->nPrimitives = nPrimitives;
+        for (const BVHPrimitiveInfo &ref : refs)
+        {
+            state.orderedIndices.push_back(ref.index);
+        }
+        return std::move(node);
+    };
+    if (nPrimitives == 1)
+    {
+        return makeLeaf();
+    }
+
+    std::optional<SplitCandidate> objectSplit = findObjectSplit(refs, 0, refs.size(), bound, centroidBound);
+
+    // spatial splits only pay off where the object split leaves the children overlapping
+    std::optional<SplitCandidate> spatialSplit;
+    if (depth < maxSpatialSplitDepth && state.duplicates < state.maxDuplicates)
+    {
+        float overlap = objectSplit.has_value() ? objectSplit->left.intersection(objectSplit->right).getSurfaceArea() : state.rootArea;
+        if (overlap > m_config.sbvhOverlapThreshold * state.rootArea)
+        {
+            spatialSplit = findSpatialSplit(refs, bound);
+        }
+    }
+
+    if (nPrimitives <= m_config.maxLeafSize 
+        && (!objectSplit.has_value() || objectSplit->cost >= leafCost(nPrimitives)) 
+        && (!spatialSplit.has_value() || spatialSplit->cost >= leafCost(nPrimitives)))
+    {
+        return makeLeaf();
+    }
+
+    std::vector<BVHPrimitiveInfo> left, right;
+    bool spatial = spatialSplit.has_value() 
+        && (!objectSplit.has_value() || spatialSplit->cost < objectSplit->cost)
+        && partitionSpatial(refs, bound, spatialSplit.value(), state, left, right);
+    if (spatial)
+    {
+        node->axis = spatialSplit->axis;
+    }
+    else
     {
-        if (std::abs(left->dist - right->dist) < zoe::lightFirstEpsilon)
+        int mid;
+        if (objectSplit.has_value())
         {
-            if (left->emissive())
+            node->axis = objectSplit->axis;
+            mid = partitionObjects(refs, 0, refs.size(), centroidBound, objectSplit.value());
+        }
+        else
+        {
+            node->axis = centroidBound.getLargestAxis();
+            mid = splitMedian(refs, 0, refs.size(), node->axis);
+        }
+        left.assign(refs.begin(), refs.begin() + mid);
+        right.assign(refs.begin() + mid, refs.end());
+    }
+    // the children own copies of the references, release ours before descending
+    std::vector<BVHPrimitiveInfo>().swap(refs);
+
+    BVHBuildNode *parent = node.get();
+#if ENABLE_OPENMP
+    #pragma omp task shared(left, state) firstprivate(parent, depth) if (left.size() >= static_cast<size_t>(m_config.parallelCutoff))
+#endif
+    parent->children[0] = recursiveBuildSBVH(left, depth + 1, state);
+    parent->children[1] = recursiveBuildSBVH(right, depth + 1, state);
+#if ENABLE_OPENMP
+    #pragma omp taskwait
+#endif
+    return node;
+}
+
+uint64_t BVH::computeHash(const std::vector<std::shared_ptr<Object>> &objects, const BVHBuildConfig &config)
+{
+    std::vector<uint64_t> hashes(objects.size());
+#if ENABLE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+        hashes[i] = objects[i]->getGeometryHash();
+    }
+
+    uint64_t hash = zoe::hashValue(cacheVersion);
+    hash = zoe::hashValue(config.splitMethod, hash);
+    hash = zoe::hashValue(config.nBuckets, hash);
+    hash = zoe::hashValue(config.maxLeafSize, hash);
+    hash = zoe::hashValue(config.traversalCostRatio, hash);
+    hash = zoe::hashValue(config.triangleBlocks, hash);
+    if (config.splitMethod == BVHBuildConfig::SplitMethod::SBVH)
+    {
+        hash = zoe::hashValue(config.sbvhDuplicationBudget, hash);
+        hash = zoe::hashValue(config.sbvhOverlapThreshold, hash);
+    }
+    if (config.splitMethod == BVHBuildConfig::SplitMethod::LBVH || config.splitMethod == BVHBuildConfig::SplitMethod::HLBVH)
+    {
+        hash = zoe::hashValue(config.mortonBits, hash);
+    }
+    return zoe::hashBytes(hashes.data(), hashes.size() * sizeof(uint64_t), hash);
+}
+
+bool BVH::saveCache(const std::string &filepath) const
+{
+    std::ofstream file(filepath, std::ios::binary | std::ios::trunc);
+    if (!file)
+    {
+        std::cerr << "Failed to write BVH cache: " << filepath << std::endl;
+        return false;
+    }
+
+    CacheHeader header = {};
+    std::memcpy(header.magic, "ZOEBVH", 6);
+    header.version = cacheVersion;
+    header.nodeSize = sizeof(LinearBVHNode);
+    header.hash = m_hash;
+    header.nObjects = m_objects.size();
+    header.nNodes = m_nodes.size();
+    header.nPrimitives = m_primIndices.size();
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(m_nodes.data()), m_nodes.size() * sizeof(LinearBVHNode));
+    file.write(reinterpret_cast<const char *>(m_primIndices.data()), m_primIndices.size() * sizeof(int));
+    return file.good();
+}
+
+std::shared_ptr<BVH> BVH::loadCache(const std::string &filepath, const std::vector<std::shared_ptr<Object>> &objects, const BVHBuildConfig &config)
+{
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(CacheHeader)))
+    {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = st.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr<BVH> bvh;
+    const CacheHeader *header = static_cast<const CacheHeader *>(data);
+    uint64_t hash = computeHash(objects, config);
+    // the counts are bounded by the file size first, so that the expected size cannot overflow
+    bool countsFit = header->nNodes <= size / sizeof(LinearBVHNode) && header->nPrimitives <= size / sizeof(int);
+    size_t expectedSize = sizeof(CacheHeader) 
+        + header->nNodes * sizeof(LinearBVHNode) 
+        + header->nPrimitives * sizeof(int);
+    if (std::memcmp(header->magic, "ZOEBVH", 6) == 0 
+        && header->version == cacheVersion 
+        && header->nodeSize == sizeof(LinearBVHNode) 
+        && header->hash == hash 
+        && header->nObjects == objects.size() 
+        && countsFit
+        && size == expectedSize)
+    {
+        const char *payload = static_cast<const char *>(data) + sizeof(CacheHeader);
+        const LinearBVHNode *nodes = reinterpret_cast<const LinearBVHNode *>(payload);
+        const int *primIndices = reinterpret_cast<const int *>(payload + header->nNodes * sizeof(LinearBVHNode));
+
+        // every offset must stay inside the file before anything walks the tree; a second child
+        // always lies behind the first one, which also rules out cycles
+        bool validNodes = true;
+        for (size_t i = 0; i < header->nNodes && validNodes; i++)
+        {
+            const LinearBVHNode &node = nodes[i];
+            if (node.nPrimitives > 0)
+            {
+                validNodes = node.primitivesOffset >= 0 
+                    && static_cast<uint64_t>(node.primitivesOffset) + node.nPrimitives <= header->nPrimitives;
+            }
+            else
+            {
+                validNodes = node.secondChildOffset > 0 
+                    && static_cast<size_t>(node.secondChildOffset) > i + 1 
+                    && static_cast<size_t>(node.secondChildOffset) < header->nNodes 
+                    && node.axis < 3;
+            }
+        }
+        if (!validNodes)
+        {
+            munmap(data, size);
+            return nullptr;
+        }
+
+        std::vector<PrimitiveRef> prims;
+        for (const auto &object : objects)
+        {
+            for (int i = 0; i < object->getPrimitiveCount(); i++)
+            {
+                prims.push_back({ object.get(), i });
+            }
+        }
+
+        bvh = std::make_shared<BVH>();
+        bvh->m_config = config;
+        bvh->m_hash = hash;
+        bvh->m_objects = objects;
+        bvh->m_nodes.assign(nodes, nodes + header->nNodes);
+        bvh->m_primIndices.assign(primIndices, primIndices + header->nPrimitives);
+        bvh->m_prims.resize(header->nPrimitives);
+        for (size_t i = 0; i < header->nPrimitives; i++)
+        {
+            if (primIndices[i] < 0 || primIndices[i] >= static_cast<int>(prims.size()))
+            {
+                bvh = nullptr;
+                break;
+            }
+            bvh->m_prims[i] = prims[primIndices[i]];
+        }
+        // a tree deeper than the traversal stacks was not written by this version of flatten
+        if (bvh && bvh->getStats().maxDepth >= maxTraversalDepth)
+        {
+            bvh = nullptr;
+        }
+        if (bvh)
+        {
+            bvh->m_buildSAHCost = bvh->getSAHCost();
+            bvh->buildTriangleBlocks();
+        }
+    }
+    munmap(data, size);
+    return bvh;
+}
+
+float BVH::getSAHCost() const
+{
+    if (m_nodes.empty())
+    {
+        return 0;
+    }
+    float rootArea = m_nodes[0].aabb.getSurfaceArea();
+    if (rootArea <= 0)
+    {
+        return 0;
+    }
+    float cost = 0;
+    for (const LinearBVHNode &node : m_nodes)
+    {
+        float area = node.aabb.getSurfaceArea() / rootArea;
+        cost += area * (node.nPrimitives > 0 ? leafCost(node.nPrimitives) : m_config.traversalCostRatio);
+    }
+    return cost;
+}
+
+BVH::Stats BVH::getStats() const
+{
+    Stats stats;
+    stats.nodes = m_nodes.size();
+    stats.sahCost = getSAHCost();
+    stats.memoryBytes = sizeof(BVH) 
+        + m_nodes.capacity() * sizeof(LinearBVHNode) 
+        + m_prims.capacity() * sizeof(PrimitiveRef) 
+        + m_primIndices.capacity() * sizeof(int)
+        + m_triangleBlocks.capacity() * sizeof(TriangleBlock)
+        + m_leafBlocks.capacity() * sizeof(int);
+
+    std::vector<int> depth(m_nodes.size(), 0);
+    long long depthSum = 0;
+    for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+        const LinearBVHNode &node = m_nodes[i];
+        stats.maxDepth = std::max(stats.maxDepth, depth[i]);
+        if (node.nPrimitives > 0)
+        {
+            stats.leaves++;
+            stats.primitives += node.nPrimitives;
+            depthSum += depth[i];
+            if (node.nPrimitives >= static_cast<int>(stats.leafSizeHistogram.size()))
+            {
+                stats.leafSizeHistogram.resize(node.nPrimitives + 1);
+            }
+            stats.leafSizeHistogram[node.nPrimitives]++;
+        }
+        else
+        {
+            stats.interiorNodes++;
+            depth[i + 1] = depth[i] + 1;
+            depth[node.secondChildOffset] = depth[i] + 1;
+        }
+    }
+    stats.averageLeafDepth = stats.leaves > 0 ? static_cast<float>(depthSum) / stats.leaves : 0;
+    return stats;
+}
+
+std::ostream &operator<<(std::ostream &os, const BVH::Stats &stats)
+{
+    os << "nodes " << stats.nodes << " (" << stats.interiorNodes << " interior, " << stats.leaves << " leaves), "
+        << "primitives " << stats.primitives << std::endl;
+    os << "depth max " << stats.maxDepth << ", average leaf " << stats.averageLeafDepth << std::endl;
+    os << "SAH cost " << stats.sahCost << ", memory " << stats.memoryBytes / 1024.0 << " KiB" << std::endl;
+    os << "leaf sizes:";
+    for (size_t i = 1; i < stats.leafSizeHistogram.size(); i++)
+    {
+        if (stats.leafSizeHistogram[i] > 0)
+        {
+            os << " " << i << ":" << stats.leafSizeHistogram[i];
+        }
+    }
+    return os;
+}
+
+bool BVH::refit()
+{
+    if (m_nodes.empty())
+    {
+        return true;
+    }
+
+    // children always follow their parent in the depth-first order, so one pass assigns the depths
+    std::vector<int> depth(m_nodes.size(), 0);
+    std::vector<std::vector<int>> levels;
+    for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+        if (depth[i] >= static_cast<int>(levels.size()))
+        {
+            levels.resize(depth[i] + 1);
+        }
+        levels[depth[i]].push_back(i);
+        if (m_nodes[i].nPrimitives == 0)
+        {
+            depth[i + 1] = depth[i] + 1;
+            depth[m_nodes[i].secondChildOffset] = depth[i] + 1;
+        }
+    }
+
+    // every level only reads the one below it
+    for (int d = levels.size() - 1; d >= 0; d--)
+    {
+        const std::vector<int> &level = levels[d];
+#if ENABLE_OPENMP
+        #pragma omp parallel for if (level.size() >= 1024)
+#endif
+        for (size_t j = 0; j < level.size(); j++)
+        {
+            LinearBVHNode &node = m_nodes[level[j]];
+            if (node.nPrimitives > 0)
+            {
+                AABB aabb;
+                for (int i = 0; i < node.nPrimitives; i++)
+                {
+                    const PrimitiveRef &prim = m_prims[node.primitivesOffset + i];
+                    aabb = aabb + prim.object->getPrimitiveAABB(prim.index);
+                }
+                node.aabb = aabb;
+            }
+            else
+            {
+                node.aabb = m_nodes[level[j] + 1].aabb + m_nodes[node.secondChildOffset].aabb;
+            }
+        }
+    }
+    buildTriangleBlocks();
+    return getSAHGrowth() <= m_config.refitRebuildThreshold;
+}
+
+float BVH::getSAHGrowth() const
+{
+    return m_buildSAHCost > 0 ? getSAHCost() / m_buildSAHCost : 1.0f;
+}
+
+bool BVH::isCloser(const PrimitiveHit &hit, const ClosestHit &closest)
+{
+    if (closest.prim == nullptr)
+    {
+        return true;
+    }
+    // prefer the emitter when two hits are almost coincident
+    if (std::abs(hit.t - closest.hit.t) < zoe::lightFirstEpsilon)
+    {
+        if (closest.hit.emissive)
+        {
+            return false;
+        }
+        if (hit.emissive)
+        {
+            return true;
+        }
+    }
+    return hit.t < closest.hit.t;
+}
+
+void BVH::buildTriangleBlocks()
+{
+    m_triangleBlocks.clear();
+    m_leafBlocks.clear();
+#if !WATERTIGHT_TRIANGLE_TEST
+    if (!m_config.triangleBlocks)
+    {
+        return;
+    }
+    m_leafBlocks.assign(m_prims.size(), -1);
+    std::array<cv::Vec3f, 3> vertices;
+    for (const LinearBVHNode &node : m_nodes)
+    {
+        // a single triangle is cheaper to test on its own
+        if (node.nPrimitives < 2)
+        {
+            continue;
+        }
+        bool triangles = true;
+        for (int i = node.primitivesOffset; i < node.primitivesOffset + node.nPrimitives && triangles; i++)
+        {
+            triangles = m_prims[i].object->getPrimitiveTriangle(m_prims[i].index, vertices);
+        }
+        if (!triangles)
+        {
+            continue;
+        }
+        m_leafBlocks[node.primitivesOffset] = m_triangleBlocks.size();
+        for (int i = 0; i < node.nPrimitives; i++)
+        {
+            if (i % TriangleBlock::width == 0)
             {
-                return left;
+                m_triangleBlocks.emplace_back();
             }
-            else if (right->emissive())
+            const PrimitiveRef &prim = m_prims[node.primitivesOffset + i];
+            prim.object->getPrimitiveTriangle(prim.index, vertices);
+            m_triangleBlocks.back().setTriangle(i % TriangleBlock::width, vertices, prim.object->isPrimitiveEmissive(prim.index));
+        }
+    }
+#endif
+}
+
+void BVH::intersectTriangleBlocks(int firstBlock, int offset, int count, Ray &ray, ClosestHit &closest) const
+{
+    constexpr int width = TriangleBlock::width;
+    float t[2 * width], u[2 * width], v[2 * width];
+    int nBlocks = (count + width - 1) / width;
+    for (int b = 0; b < nBlocks; b += 2)
+    {
+        int n = std::min(2, nBlocks - b);
+        const TriangleBlock *blocks = &m_triangleBlocks[firstBlock + b];
+        int lane;
+        int mask = TriangleBlock::intersect(blocks, n, ray, t, u, v, lane);
+        int emissiveMask = blocks[0].emissiveMask | (n == 2 ? blocks[1].emissiveMask << width : 0);
+        // without emitters only the nearest lane can win, otherwise the tie-break needs every hit in order
+        int candidates = mask & emissiveMask ? mask : (mask ? 1 << lane : 0);
+        for (int i = 0; candidates; i++, candidates >>= 1)
+        {
+            PrimitiveHit hit;
+            hit.t = t[i];
+            hit.u = u[i];
+            hit.v = v[i];
+            hit.emissive = emissiveMask >> i & 1;
+            if ((candidates & 1) && isCloser(hit, closest))
             {
-                return right;
+                closest.prim = &m_prims[offset + b * width + i];
+                closest.hit = hit;
+                closest.rayTMax = ray.getTMax();
+                ray.setTMax(hit.emissive ? hit.t : hit.t + zoe::lightFirstEpsilon);
             }
         }
-        return left->dist < right->dist ? left : right;
     }
-    return left ? left : right;
-}
\ No newline at end of file
+}
+
+void BVH::intersectLeaf(int offset, int count, Ray &ray, ClosestHit &closest) const
+{
+    BVH_STATS_ADD(primitivesTested, count);
+    if (!m_leafBlocks.empty() && m_leafBlocks[offset] >= 0)
+    {
+        intersectTriangleBlocks(m_leafBlocks[offset], offset, count, ray, closest);
+        return;
+    }
+    PrimitiveHit hit;
+    for (int i = offset; i < offset + count; i++)
+    {
+        if (m_prims[i].object->hitPrimitive(ray, m_prims[i].index, hit) && isCloser(hit, closest))
+        {
+            closest.prim = &m_prims[i];
+            closest.hit = hit;
+            closest.rayTMax = ray.getTMax();
+            // an emitter just behind a non-emissive hit still wins the tie-break
+            ray.setTMax(hit.emissive ? hit.t : hit.t + zoe::lightFirstEpsilon);
+        }
+    }
+}
+
+std::optional<HitPayload> BVH::makeHit(const Ray &ray, const ClosestHit &closest)
+{
+    if (closest.prim == nullptr)
+    {
+        return std::nullopt;
+    }
+    Ray r = ray;
+    r.setTMax(closest.rayTMax);
+    return closest.prim->object->makePrimitiveHit(r, closest.prim->index, closest.hit);
+}
+
+bool BVH::occludedLeaf(int offset, int count, const Ray &ray) const
+{
+    if (!m_leafBlocks.empty() && m_leafBlocks[offset] >= 0)
+    {
+        BVH_STATS_ADD(primitivesTested, count);
+        constexpr int width = TriangleBlock::width;
+        float t[2 * width], u[2 * width], v[2 * width];
+        int nBlocks = (count + width - 1) / width;
+        for (int b = 0; b < nBlocks; b += 2)
+        {
+            int lane;
+            if (TriangleBlock::intersect(&m_triangleBlocks[m_leafBlocks[offset] + b], std::min(2, nBlocks - b), ray, t, u, v, lane))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    for (int i = offset; i < offset + count; i++)
+    {
+        BVH_STATS_ADD(primitivesTested, 1);
+        if (m_prims[i].object->occludedPrimitive(ray, m_prims[i].index))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::optional<HitPayload> BVH::intersect(const Ray &ray) const
+{
+    return makeHit(ray, intersectClosest(ray));
+}
+
+BVH::ClosestHit BVH::intersectClosest(const Ray &ray) const
+{
+    ClosestHit closest;
+    if (m_nodes.empty())
+    {
+        return closest;
+    }
+
+    BVH_STATS_ADD(rays, 1);
+    // the local copy carries the shrinking tMax
+    Ray r = ray;
+    intersectSubtree(0, r, closest);
+    return closest;
+}
+
+void BVH::intersectSubtree(int root, Ray &r, ClosestHit &closest) const
+{
+    const int *dirIsNeg = r.getDirIsNeg();
+
+    int toVisit[maxTraversalDepth];
+    int toVisitOffset = 0;
+    int current = root;
+    while (true)
+    {
+        const LinearBVHNode &node = m_nodes[current];
+        BVH_STATS_ADD(nodesVisited, 1);
+        BVH_STATS_ADD(boxesTested, 1);
+        if (node.aabb.intersect(r))
+        {
+            if (node.nPrimitives > 0)
+            {
+                intersectLeaf(node.primitivesOffset, node.nPrimitives, r, closest);
+            }
+            else
+            {
+                // visit the near child first so that the far one is likely culled by tMax
+                if (dirIsNeg[node.axis])
+                {
+                    toVisit[toVisitOffset++] = current + 1;
+                    current = node.secondChildOffset;
+                }
+                else
+                {
+                    toVisit[toVisitOffset++] = node.secondChildOffset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (toVisitOffset == 0)
+        {
+            break;
+        }
+        current = toVisit[--toVisitOffset];
+    }
+}
+
+void BVH::intersectLeaf(int offset, int count, RayPacket &packet, int activeMask, PrimitiveHit *hits, ClosestHit *closest) const
+{
+    for (int i = offset; i < offset + count; i++)
+    {
+        BVH_STATS_ADD(primitivesTested, __builtin_popcount(activeMask));
+        int hitMask = m_prims[i].object->intersectPacket(packet, m_prims[i].index, activeMask, hits);
+        for (int lane = 0; hitMask; lane++, hitMask >>= 1)
+        {
+            if ((hitMask & 1) && isCloser(hits[lane], closest[lane]))
+            {
+                closest[lane].prim = &m_prims[i];
+                closest[lane].hit = hits[lane];
+                closest[lane].rayTMax = packet.tMax[lane];
+                packet.tMax[lane] = hits[lane].emissive ? hits[lane].t : hits[lane].t + zoe::lightFirstEpsilon;
+            }
+        }
+    }
+}
+
+void BVH::intersect(const RayPacket &packet, std::optional<HitPayload> *closest) const
+{
+    if (m_nodes.empty())
+    {
+        return;
+    }
+
+    if (!packet.isCoherent())
+    {
+        for (int lane = 0; lane < packet.size; lane++)
+        {
+            if (packet.validMask >> lane & 1)
+            {
+                closest[lane] = intersect(packet.getRay(lane));
+            }
+        }
+        return;
+    }
+
+    BVH_STATS_ADD(rays, __builtin_popcount(packet.validMask));
+    // the local copy carries the shrinking tMax of every lane
+    RayPacket p = packet;
+    int octant = p.octant[__builtin_ctz(p.validMask)];
+    // scratch for the hits of one primitive
+    PrimitiveHit hits[RayPacket::maxSize];
+    ClosestHit best[RayPacket::maxSize];
+
+    struct StackEntry
+    {
+        int node;
+        int mask;
+    };
+    StackEntry toVisit[maxTraversalDepth];
+    int toVisitOffset = 0;
+    int current = 0;
+    int mask = p.validMask;
+    while (true)
+    {
+        const LinearBVHNode &node = m_nodes[current];
+        BVH_STATS_ADD(nodesVisited, 1);
+        BVH_STATS_ADD(boxesTested, __builtin_popcount(mask));
+        mask = node.aabb.intersect(p, mask);
+        if (mask && (mask & (mask - 1)) == 0)
+        {
+            // a single lane is left, the packet bookkeeping no longer pays off
+            int lane = __builtin_ctz(mask);
+            Ray r = p.getRay(lane);
+            intersectSubtree(current, r, best[lane]);
+            p.tMax[lane] = r.getTMax();
+        }
+        else if (mask)
+        {
+            if (node.nPrimitives > 0)
+            {
+                intersectLeaf(node.primitivesOffset, node.nPrimitives, p, mask, hits, best);
+            }
+            else
+            {
+                if (octant >> node.axis & 1)
+                {
+                    toVisit[toVisitOffset++] = { current + 1, mask };
+                    current = node.secondChildOffset;
+                }
+                else
+                {
+                    toVisit[toVisitOffset++] = { node.secondChildOffset, mask };
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (toVisitOffset == 0)
+        {
+            break;
+        }
+        --toVisitOffset;
+        current = toVisit[toVisitOffset].node;
+        mask = toVisit[toVisitOffset].mask;
+    }
+
+    for (int lane = 0; lane < packet.size; lane++)
+    {
+        if (packet.validMask >> lane & 1)
+        {
+            closest[lane] = makeHit(packet.getRay(lane), best[lane]);
+        }
+    }
+}
+
+bool BVH::occluded(const Ray &ray, float tMax) const
+{
+    if (m_nodes.empty())
+    {
+        return false;
+    }
+
+    BVH_STATS_ADD(rays, 1);
+    Ray r = ray;
+    r.setTMax(tMax);
+    const int *dirIsNeg = r.getDirIsNeg();
+
+    int toVisit[maxTraversalDepth];
+    int toVisitOffset = 0;
+    int current = 0;
+    while (true)
+    {
+        const LinearBVHNode &node = m_nodes[current];
+        BVH_STATS_ADD(nodesVisited, 1);
+        BVH_STATS_ADD(boxesTested, 1);
+        if (node.aabb.intersect(r))
+        {
+            if (node.nPrimitives > 0)
+            {
+                if (occludedLeaf(node.primitivesOffset, node.nPrimitives, r))
+                {
+                    return true;
+                }
+            }
+            else
+            {
+                if (dirIsNeg[node.axis])
+                {
+                    toVisit[toVisitOffset++] = current + 1;
+                    current = node.secondChildOffset;
+                }
+                else
+                {
+                    toVisit[toVisitOffset++] = node.secondChildOffset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (toVisitOffset == 0)
+        {
+            break;
+        }
+        current = toVisit[--toVisitOffset];
+    }
+    return false;
+}
@@ -2,41 +2,299 @@
 #define __COMMON_BVH_H__
 
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
 #include "common/AABB.h"
 #include "common/Ray.h"
+#include "common/RayPacket.h"
+#include "common/TriangleBlock.h"
 #include "objects/HitPayload.h"
 
 class Object;
 
+struct BVHBuildConfig
+{
+    enum class SplitMethod
+    {
+        MEDIAN,     // split at the median centroid along the largest axis
+        SAH,        // binned surface area heuristic
+        SBVH,       // SAH with spatial splits that may duplicate object references
+        LBVH,       // split at the highest differing bit of sorted centroid Morton codes
+        HLBVH       // LBVH treelets joined by a SAH build over their roots
+    };
+
+    SplitMethod splitMethod = SplitMethod::SAH;
+    int nBuckets = 16;                  // SAH bins per axis
+    int maxLeafSize = 4;                // most primitives per leaf, SAH decides whether a small node stays a leaf
+    float traversalCostRatio = 0.125f;  // cost of a node traversal relative to a primitive intersection
+    int parallelCutoff = 4096;          // subtrees with fewer primitives are built on the current thread
+    float sbvhDuplicationBudget = 0.5f; // SBVH: extra references allowed, as a fraction of the object count
+    float sbvhOverlapThreshold = 1e-5f; // SBVH: child overlap, relative to the root area, above which spatial splits are tried
+    int mortonBits = 30;                // LBVH/HLBVH: 30 or 63 bit Morton codes
+    float refitRebuildThreshold = 1.5f; // refit reports a needed rebuild once the SAH cost has grown by this factor
+    int width = 2;                      // branching factor used for traversal: 2, 4 (SSE) or 8 (AVX2)
+    bool quantizeWideNodes = false;     // store the wide nodes with 8-bit child bounds, roughly half the memory
+    bool triangleBlocks = true;         // pack leaf triangles into SoA blocks tested with SIMD, the SAH prices a leaf per block
+};
+
 class BVH
 {
 public:
-    class BVHNode
+    /**
+     * @brief Node of the flattened BVH, stored in depth-first order.
+     *        The first child of an interior node directly follows it in the array,
+     *        the second child is located by secondChildOffset.
+     */
+    struct alignas(32) LinearBVHNode
     {
-    public:
-        std::shared_ptr<Object> obj = nullptr;
-        std::shared_ptr<BVHNode> left = nullptr;
-        std::shared_ptr<BVHNode> right = nullptr;
         AABB aabb;
+        union
+        {
+            int primitivesOffset;   // leaf: index of the first primitive
+            int secondChildOffset;  // interior: index of the second child
+        };
+        uint16_t nPrimitives;       // 0 for interior nodes
+        uint8_t axis;               // interior: split axis
+        uint8_t pad;
+    };
+    static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fit in 32 bytes");
+
+    // a primitive of an object, e.g. one face of a TriangleMesh, the unit the leaves refer to
+    struct PrimitiveRef
+    {
+        const Object *object;
+        int index;
+    };
+
+    // the closest hit of a traversal so far, its payload is only built when the traversal ends
+    struct ClosestHit
+    {
+        const PrimitiveRef *prim = nullptr;
+        PrimitiveHit hit;
+        float rayTMax = 0;  // tMax of the ray that found the hit, see Object::makePrimitiveHit
+    };
+
+    // shape of the built hierarchy
+    struct Stats
+    {
+        int nodes = 0;
+        int interiorNodes = 0;
+        int leaves = 0;
+        int primitives = 0;                 // references, larger than the primitive count after spatial splits
+        std::vector<int> leafSizeHistogram; // number of leaves by primitive count
+        int maxDepth = 0;
+        float averageLeafDepth = 0;
+        float sahCost = 0;
+        size_t memoryBytes = 0;             // nodes, primitive references, the primitive order and the triangle blocks
+
+        friend std::ostream &operator<<(std::ostream &os, const Stats &stats);
     };
+
+    // wall time of each build phase in milliseconds
+    struct BuildTimes
+    {
+        double bounds = 0;
+        double build = 0;
+        double flatten = 0;
+    };
+
 private:
-    using obj_iter = std::vector<std::shared_ptr<Object>>::iterator;
+    // bounds and centroid of every primitive, computed once before the build
+    struct BVHPrimitiveInfo
+    {
+        AABB aabb;
+        cv::Vec3f centroid;
+        int index;          // index of the object in the input order
+    };
+
+    struct SplitCandidate
+    {
+        float cost;
+        int axis;
+        int bucket;
+        AABB left;
+        AABB right;
+    };
 
-    std::shared_ptr<BVHNode> m_root = nullptr;
+    struct MortonPrimitive
+    {
+        uint64_t code;
+        int index;          // index into primInfo
+    };
+
+    // shared by the tasks of a spatial split build
+    struct SBVHState
+    {
+        std::atomic<int> totalNodes = 0;
+        std::atomic<int> duplicates = 0;
+        int maxDuplicates = 0;
+        float rootArea = 0;
+        std::mutex mutex;
+        std::vector<int> orderedIndices;
+    };
+
+    // temporary pointer-based node, flattened into LinearBVHNode after the build
+    struct BVHBuildNode
+    {
+        AABB aabb;
+        std::unique_ptr<BVHBuildNode> children[2];
+        int axis = 0;
+        int firstPrimOffset = 0;
+        int nPrimitives = 0;
+    };
+
+    // header of the on-disk cache, followed by the nodes and the primitive order
+    struct CacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t nodeSize;
+        uint64_t hash;
+        uint64_t nObjects;
+        uint64_t nNodes;
+        uint64_t nPrimitives;
+        uint8_t reserved[16];
+    };
+    static_assert(sizeof(CacheHeader) % alignof(LinearBVHNode) == 0, "nodes must stay aligned after the cache header");
+
+    // size of the traversal stacks, flatten turns the nodes at depth maxTraversalDepth - 1 into leaves
+    static constexpr int maxTraversalDepth = 64;
+    // SBVH: below this depth only object splits are tried, it bounds the duplication and not the tree depth
+    static constexpr int maxSpatialSplitDepth = 48;
+    // HLBVH: primitives sharing the top bits of their Morton codes form one treelet
+    static constexpr int treeletBits = 12;
+    // bumped whenever the stored data changes meaning, older caches are then rebuilt
+    // 2: primitive references instead of object indices, 3: leaves laid out for triangle blocks, 4: depth capped at maxTraversalDepth
+    static constexpr uint32_t cacheVersion = 4;
+
+    BVHBuildConfig m_config;
+    BuildTimes m_buildTimes;
+    uint64_t m_hash = 0;
+    float m_buildSAHCost = 0;   // SAH cost right after the build, the reference for refits
+    std::vector<LinearBVHNode> m_nodes;
+    // the input objects, they own the primitives referenced by m_prims
     std::vector<std::shared_ptr<Object>> m_objects;
+    // primitives in leaf order
+    std::vector<PrimitiveRef> m_prims;
+    // input index of every primitive in m_prims, counted over the primitives of all objects
+    std::vector<int> m_primIndices;
+    // triangles of the leaves that consist of several triangles, packed for TriangleBlock::intersect
+    std::vector<TriangleBlock> m_triangleBlocks;
+    // first block of the leaf starting at each offset of m_prims, -1 if that leaf has no blocks
+    std::vector<int> m_leafBlocks;
+
+    void init();
+    std::unique_ptr<BVHBuildNode> recursiveBuild(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end, std::atomic<int> &totalNodes) const;
+    std::unique_ptr<BVHBuildNode> recursiveBuildSBVH(std::vector<BVHPrimitiveInfo> &refs, int depth, SBVHState &state) const;
+    // Morton codes of the centroids in sorted order, primInfo is reordered to match; called outside any parallel region
+    std::vector<MortonPrimitive> sortMorton(std::vector<BVHPrimitiveInfo> &primInfo) const;
+    // LBVH or HLBVH over the sorted codes, spawns tasks and runs inside a parallel region
+    std::unique_ptr<BVHBuildNode> buildMorton(const std::vector<BVHPrimitiveInfo> &primInfo, const std::vector<MortonPrimitive> &morton, std::atomic<int> &totalNodes) const;
+    std::unique_ptr<BVHBuildNode> emitLBVH(const std::vector<BVHPrimitiveInfo> &primInfo, const std::vector<MortonPrimitive> &morton, int start, int end, int bitIndex, std::atomic<int> &totalNodes) const;
+    std::unique_ptr<BVHBuildNode> buildUpperSAH(std::vector<BVHPrimitiveInfo> &rootInfo, int start, int end, std::vector<std::unique_ptr<BVHBuildNode>> &treelets, std::atomic<int> &totalNodes) const;
+    /**
+     * @brief Emit the subtree below node in depth-first order
+     * @param primIndices Receives the input indices of the primitives of every leaf in leaf order
+     */
+    int flatten(const BVHBuildNode *node, int depth, std::vector<int> &primIndices);
+    // the input indices of the primitives below node, in leaf order
+    void collectPrimitives(const BVHBuildNode *node, std::vector<int> &primIndices) const;
+
+    int splitMedian(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end, int axis) const;
+    // SAH cost of a leaf, in primitive intersections; packed triangles are tested a block at a time
+    float leafCost(int nPrimitives) const;
+    std::optional<SplitCandidate> findObjectSplit(const std::vector<BVHPrimitiveInfo> &primInfo, int start, int end, const AABB &bound, const AABB &centroidBound) const;
+    int partitionObjects(std::vector<BVHPrimitiveInfo> &primInfo, int start, int end, const AABB &centroidBound, const SplitCandidate &split) const;
+    std::optional<SplitCandidate> findSpatialSplit(const std::vector<BVHPrimitiveInfo> &refs, const AABB &bound) const;
+    bool partitionSpatial(const std::vector<BVHPrimitiveInfo> &refs, const AABB &bound, const SplitCandidate &split, SBVHState &state, std::vector<BVHPrimitiveInfo> &left, std::vector<BVHPrimitiveInfo> &right) const;
+    int bucketIndex(float value, float min, float extent) const;
+
+    // pack the triangles of every eligible leaf, after a build, a cache load or a refit
+    void buildTriangleBlocks();
+    void intersectTriangleBlocks(int firstBlock, int offset, int count, Ray &ray, ClosestHit &closest) const;
 
-    std::shared_ptr<BVH::BVHNode> init();
-    std::shared_ptr<BVH::BVHNode> init(obj_iter begin, obj_iter end);
+    static bool isCloser(const PrimitiveHit &hit, const ClosestHit &closest);
+    // single-ray traversal of the subtree below root
+    void intersectSubtree(int root, Ray &ray, ClosestHit &closest) const;
+    void intersectLeaf(int offset, int count, RayPacket &packet, int activeMask, PrimitiveHit *hits, ClosestHit *closest) const;
     
 public:
     BVH() = default;
-    BVH(const std::vector<std::shared_ptr<Object>> &objects);
+    BVH(const std::vector<std::shared_ptr<Object>> &objects, const BVHBuildConfig &config = BVHBuildConfig());
+
+    const BVHBuildConfig &getConfig() const { return m_config; }
+    const BuildTimes &getBuildTimes() const { return m_buildTimes; }
+    uint64_t getHash() const { return m_hash; }
+    const std::vector<LinearBVHNode> &getNodes() const { return m_nodes; }
+    const std::vector<std::shared_ptr<Object>> &getObjects() const { return m_objects; }
+    const std::vector<PrimitiveRef> &getPrimitives() const { return m_prims; }
+
+    /**
+     * @brief Hash of the objects' geometry and the build settings, used as the cache key
+     */
+    static uint64_t computeHash(const std::vector<std::shared_ptr<Object>> &objects, const BVHBuildConfig &config);
+
+    /**
+     * @brief Write the built hierarchy to a versioned binary file
+     * @return false if the file could not be written
+     */
+    bool saveCache(const std::string &filepath) const;
+
+    /**
+     * @brief Map a cache written by saveCache back into memory
+     * @param objects The objects in the same order as they were given to the constructor
+     * @return nullptr if the file is missing, outdated or was built from other geometry or settings
+     */
+    static std::shared_ptr<BVH> loadCache(const std::string &filepath, const std::vector<std::shared_ptr<Object>> &objects, const BVHBuildConfig &config);
+
+    /**
+     * @brief Expected cost of a random ray query under the surface area heuristic,
+     *        in units of one primitive intersection.
+     */
+    float getSAHCost() const;
+
+    /**
+     * @brief Recompute the bounds of every node after the objects moved, keeping the topology.
+     *        Levels are updated bottom-up, the nodes of one level in parallel.
+     *        The cache key is not updated, a refitted BVH should not be saved.
+     * @return false if the SAH cost has grown past refitRebuildThreshold and a rebuild is advised
+     */
+    bool refit();
+
+    // SAH cost relative to the cost right after the build
+    float getSAHGrowth() const;
+
+    Stats getStats() const;
+
+    std::optional<HitPayload> intersect(const Ray &ray) const;
+    // the closest hit without its payload, e.g. for an Instance that builds it only if the hit wins
+    ClosestHit intersectClosest(const Ray &ray) const;
 
-    std::shared_ptr<BVHNode> getRoot() const { return m_root; }
+    /**
+     * @brief Closest hits of a ray packet. The rays walk the tree together with a mask of the lanes
+     *        that overlap the node; a packet spanning several direction octants, or a subtree
+     *        entered by a single lane, falls back to single-ray traversal.
+     * @param closest Lane i receives the closest hit of ray i
+     */
+    void intersect(const RayPacket &packet, std::optional<HitPayload> *closest) const;
 
-    std::optional<HitPayload> intersect(const Ray &ray);
+    /**
+     * @brief Intersect the primitives of a leaf, shared by every hierarchy built on top of this BVH
+     * @param ray The ray, its tMax shrinks when a closer hit is accepted
+     * @param closest The closest hit so far, updated in place
+     */
+    void intersectLeaf(int offset, int count, Ray &ray, ClosestHit &closest) const;
+    // the payload of the closest hit of ray, nullopt if nothing was hit
+    static std::optional<HitPayload> makeHit(const Ray &ray, const ClosestHit &closest);
+    bool occludedLeaf(int offset, int count, const Ray &ray) const;
 
-    static std::optional<HitPayload> intersect(const std::shared_ptr<BVHNode> &node, const Ray &ray);
+    /**
+     * @brief Any-hit query, stops at the first object hit in front of tMax
+     * @param ray The shadow ray
+     * @param tMax The distance to the point being tested for visibility
+     */
+    bool occluded(const Ray &ray, float tMax) const;
 };
 
-#endif
\ No newline at end of file
+#endif
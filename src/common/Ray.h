@@ -1,6 +1,7 @@
 #ifndef __COMMON_RAY_H__
 #define __COMMON_RAY_H__
 
+#include <limits>
 #include <opencv2/opencv.hpp>
 
 class Ray
@@ -8,18 +9,39 @@ class Ray
 private:
     cv::Vec3f m_orig;
     cv::Vec3f m_dir;
+    // 1 / dir, infinite for zero components so that slab tests need no division or special case
+    cv::Vec3f m_invDir;
+    int m_dirIsNeg[3];
+    // hits outside [tMin, tMax] are rejected, closest-hit queries shrink tMax as they go
+    float m_tMin;
+    float m_tMax;
 
 public:
     Ray() = delete;
-    Ray(const cv::Vec3f &orig, const cv::Vec3f &dir) :
+    Ray(const cv::Vec3f &orig, const cv::Vec3f &dir, float tMax = std::numeric_limits<float>::max(), float tMin = 0) :
         m_orig(orig),
-        m_dir(dir)
+        m_dir(dir),
+        m_tMin(tMin),
+        m_tMax(tMax)
     {
         m_dir = cv::normalize(m_dir);
+        for (int i = 0; i < 3; i++)
+        {
+            m_invDir[i] = 1.0f / m_dir[i];
+            // taken from the reciprocal so that -0 picks the planes matching its -inf
+            m_dirIsNeg[i] = m_invDir[i] < 0;
+        }
     }
 
     const cv::Vec3f &getOrig() const { return m_orig; }
     const cv::Vec3f &getDir() const { return m_dir; }
+    const cv::Vec3f &getInvDir() const { return m_invDir; }
+    const int *getDirIsNeg() const { return m_dirIsNeg; }
+    float getTMin() const { return m_tMin; }
+    float getTMax() const { return m_tMax; }
+
+    void setTMin(float tMin) { m_tMin = tMin; }
+    void setTMax(float tMax) { m_tMax = tMax; }
 };
 
-#endif
\ No newline at end of file
+#endif
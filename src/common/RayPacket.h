@@ -0,0 +1,83 @@
+#ifndef __COMMON_RAYPACKET_H__
+#define __COMMON_RAYPACKET_H__
+
+#include <cassert>
+#include <optional>
+#include <opencv2/opencv.hpp>
+#include "common/Ray.h"
+
+/**
+ * @brief 4, 8 or 16 rays traced together, stored as SoA so that the box and triangle tests
+ *        run one ray per SIMD lane. Lanes without a ray (e.g. at the border of the image) stay inactive.
+ */
+struct alignas(64) RayPacket
+{
+    static constexpr int maxSize = 16;
+
+    float orig[3][maxSize] = {};
+    float dir[3][maxSize] = {};
+    float invDir[3][maxSize] = {};
+    float tMin[maxSize] = {};
+    float tMax[maxSize] = {};
+    int octant[maxSize] = {};  // dirIsNeg of each lane packed into 3 bits
+    int size;
+    int validMask = 0;      // lanes that carry a ray
+    // the rays themselves, lanes that leave the packet continue as single rays bit-exactly
+    std::optional<Ray> rays[maxSize];
+
+    explicit RayPacket(int size_) : size(size_)
+    {
+        assert(size == 4 || size == 8 || size == 16);
+    }
+
+    void setRay(int lane, const Ray &ray)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            orig[a][lane] = ray.getOrig()[a];
+            dir[a][lane] = ray.getDir()[a];
+            invDir[a][lane] = ray.getInvDir()[a];
+        }
+        tMin[lane] = ray.getTMin();
+        tMax[lane] = ray.getTMax();
+        const int *dirIsNeg = ray.getDirIsNeg();
+        octant[lane] = dirIsNeg[0] | dirIsNeg[1] << 1 | dirIsNeg[2] << 2;
+        validMask |= 1 << lane;
+        rays[lane] = ray;
+    }
+
+    /**
+     * @brief The ray of a lane with its current tMax
+     */
+    Ray getRay(int lane) const
+    {
+        Ray ray = rays[lane].value();
+        ray.setTMax(tMax[lane]);
+        return ray;
+    }
+
+    /**
+     * @brief Whether all rays share one direction octant, so that one near-to-far child order suits all of them
+     */
+    bool isCoherent() const
+    {
+        int first = -1;
+        for (int i = 0; i < size; i++)
+        {
+            if (validMask >> i & 1)
+            {
+                if (first < 0)
+                {
+                    first = octant[i];
+                }
+                else if (octant[i] != first)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+#endif
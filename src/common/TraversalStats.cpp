@@ -0,0 +1,86 @@
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include "common/TraversalStats.h"
+
+namespace {
+
+std::mutex registryMutex;
+std::vector<TraversalCounters *> registry;
+TraversalCounters retired;
+
+// registers the counters of a thread on first use, keeps its totals when the thread exits
+struct ThreadCounters
+{
+    TraversalCounters counters;
+
+    ThreadCounters()
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        registry.push_back(&counters);
+    }
+
+    ~ThreadCounters()
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        retired += counters;
+        registry.erase(std::find(registry.begin(), registry.end(), &counters));
+    }
+};
+
+}
+
+TraversalCounters &TraversalCounters::operator+=(const TraversalCounters &other)
+{
+    rays += other.rays;
+    nodesVisited += other.nodesVisited;
+    boxesTested += other.boxesTested;
+    primitivesTested += other.primitivesTested;
+    paths += other.paths;
+    pathSegments += other.pathSegments;
+    traces += other.traces;
+    return *this;
+}
+
+std::ostream &operator<<(std::ostream &os, const TraversalCounters &counters)
+{
+    double rays = std::max<uint64_t>(counters.rays, 1);
+    os << "rays " << counters.rays 
+        << ", per ray: nodes " << counters.nodesVisited / rays 
+        << ", boxes " << counters.boxesTested / rays 
+        << ", primitives " << counters.primitivesTested / rays;
+    if (counters.paths > 0)
+    {
+        os << "; paths " << counters.paths 
+            << ", per path: segments " << counters.pathSegments / static_cast<double>(counters.paths) 
+            << ", traces " << counters.traces / static_cast<double>(counters.paths);
+    }
+    return os;
+}
+
+TraversalCounters &TraversalStats::local()
+{
+    thread_local ThreadCounters threadCounters;
+    return threadCounters.counters;
+}
+
+TraversalCounters TraversalStats::collect()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    TraversalCounters total = retired;
+    for (const TraversalCounters *counters : registry)
+    {
+        total += *counters;
+    }
+    return total;
+}
+
+void TraversalStats::reset()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    retired = TraversalCounters();
+    for (TraversalCounters *counters : registry)
+    {
+        *counters = TraversalCounters();
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef __COMMON_TRAVERSALSTATS_H__
+#define __COMMON_TRAVERSALSTATS_H__
+
+#include <cstdint>
+#include <iostream>
+#include "common/utils.h"
+
+// per-ray work of the BVH traversals and per-path work of the integrator, compiled out unless ENABLE_BVH_STATS is set
+#if ENABLE_BVH_STATS
+#define BVH_STATS_ADD(counter, n) (TraversalStats::local().counter += (n))
+#else
+#define BVH_STATS_ADD(counter, n) ((void)0)
+#endif
+
+struct TraversalCounters
+{
+    uint64_t rays = 0;              // closest-hit and occlusion queries
+    uint64_t nodesVisited = 0;
+    uint64_t boxesTested = 0;       // a wide node tests all of its child boxes at once
+    uint64_t primitivesTested = 0;
+    uint64_t paths = 0;
+    uint64_t pathSegments = 0;      // rays the integrator extended its paths along
+    uint64_t traces = 0;            // single-ray closest-hit queries through Scene::trace, one per segment
+
+    TraversalCounters &operator+=(const TraversalCounters &other);
+    friend std::ostream &operator<<(std::ostream &os, const TraversalCounters &counters);
+};
+
+class TraversalStats
+{
+public:
+    /**
+     * @brief Counters of the calling thread, cheap to update without synchronization
+     */
+    static TraversalCounters &local();
+
+    /**
+     * @brief Sum of the counters of all threads, including threads that have exited
+     */
+    static TraversalCounters collect();
+
+    /**
+     * @brief Clear all counters, must not run concurrently with a traversal
+     */
+    static void reset();
+};
+
+#endif
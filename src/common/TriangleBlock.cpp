@@ -0,0 +1,170 @@
+#include <limits>
+#include "common/TriangleBlock.h"
+#include "common/utils.h"
+#if ZOE_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+#if ZOE_X86
+int intersectSSE(const TriangleBlock &block, const Ray &ray, float *tHit, float *uHit, float *vHit, int &closest)
+{
+    __m128 d[3], s[3], n[3];
+    for (int a = 0; a < 3; a++)
+    {
+        d[a] = _mm_set1_ps(ray.getDir()[a]);
+        s[a] = _mm_sub_ps(_mm_set1_ps(ray.getOrig()[a]), _mm_load_ps(block.v0[a]));
+        n[a] = _mm_load_ps(block.normal[a]);
+    }
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 signBit = _mm_set1_ps(-0.0f);
+    __m128 det = _mm_xor_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], n[0]), _mm_mul_ps(d[1], n[1])), _mm_mul_ps(d[2], n[2])), signBit);
+    __m128 invDet = _mm_div_ps(one, det);
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(s[1], d[2]), _mm_mul_ps(s[2], d[1]));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(s[2], d[0]), _mm_mul_ps(s[0], d[2]));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(s[0], d[1]), _mm_mul_ps(s[1], d[0]));
+
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(s[0], n[0]), _mm_mul_ps(s[1], n[1])), _mm_mul_ps(s[2], n[2])), invDet);
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(block.edge2[0]), qx), _mm_mul_ps(_mm_load_ps(block.edge2[1]), qy)), _mm_mul_ps(_mm_load_ps(block.edge2[2]), qz)), invDet);
+    __m128 v = _mm_mul_ps(_mm_xor_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(block.edge1[0]), qx), _mm_mul_ps(_mm_load_ps(block.edge1[1]), qy)), _mm_mul_ps(_mm_load_ps(block.edge1[2]), qz)), signBit), invDet);
+    __m128 hit = _mm_andnot_ps(_mm_cmpeq_ps(det, zero), _mm_cmpge_ps(t, _mm_set1_ps(zoe::selfCrossEpsilon)));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(t, _mm_set1_ps(ray.getTMax())));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), one));
+    _mm_storeu_ps(tHit, t);
+    _mm_storeu_ps(uHit, u);
+    _mm_storeu_ps(vHit, v);
+
+    // horizontal min over the distances of the lanes hit
+    __m128 tm = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, _mm_set1_ps(std::numeric_limits<float>::infinity())));
+    __m128 m = _mm_min_ps(tm, _mm_shuffle_ps(tm, tm, _MM_SHUFFLE(2, 3, 0, 1)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    int mask = _mm_movemask_ps(hit);
+    closest = mask ? __builtin_ctz(_mm_movemask_ps(_mm_and_ps(_mm_cmpeq_ps(tm, m), hit))) : -1;
+    return mask;
+}
+
+__attribute__((target("avx2")))
+__m256 loadPair(const float *lo, const float *hi)
+{
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(lo)), _mm_load_ps(hi), 1);
+}
+
+__attribute__((target("avx2")))
+int intersectAVX2(const TriangleBlock *blocks, const Ray &ray, float *tHit, float *uHit, float *vHit, int &closest)
+{
+    __m256 d[3], s[3], n[3], e1[3], e2[3];
+    for (int a = 0; a < 3; a++)
+    {
+        d[a] = _mm256_set1_ps(ray.getDir()[a]);
+        s[a] = _mm256_sub_ps(_mm256_set1_ps(ray.getOrig()[a]), loadPair(blocks[0].v0[a], blocks[1].v0[a]));
+        n[a] = loadPair(blocks[0].normal[a], blocks[1].normal[a]);
+        e1[a] = loadPair(blocks[0].edge1[a], blocks[1].edge1[a]);
+        e2[a] = loadPair(blocks[0].edge2[a], blocks[1].edge2[a]);
+    }
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 signBit = _mm256_set1_ps(-0.0f);
+    __m256 det = _mm256_xor_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d[0], n[0]), _mm256_mul_ps(d[1], n[1])), _mm256_mul_ps(d[2], n[2])), signBit);
+    __m256 invDet = _mm256_div_ps(one, det);
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(s[1], d[2]), _mm256_mul_ps(s[2], d[1]));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(s[2], d[0]), _mm256_mul_ps(s[0], d[2]));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(s[0], d[1]), _mm256_mul_ps(s[1], d[0]));
+
+    __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(s[0], n[0]), _mm256_mul_ps(s[1], n[1])), _mm256_mul_ps(s[2], n[2])), invDet);
+    __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2[0], qx), _mm256_mul_ps(e2[1], qy)), _mm256_mul_ps(e2[2], qz)), invDet);
+    __m256 v = _mm256_mul_ps(_mm256_xor_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1[0], qx), _mm256_mul_ps(e1[1], qy)), _mm256_mul_ps(e1[2], qz)), signBit), invDet);
+    __m256 hit = _mm256_andnot_ps(_mm256_cmp_ps(det, zero, _CMP_EQ_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(zoe::selfCrossEpsilon), _CMP_GE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, _mm256_set1_ps(ray.getTMax()), _CMP_LE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, zero, _CMP_GE_OQ)));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+    _mm256_storeu_ps(tHit, t);
+    _mm256_storeu_ps(uHit, u);
+    _mm256_storeu_ps(vHit, v);
+
+    __m256 tm = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::infinity()), t, hit);
+    __m256 m = _mm256_min_ps(tm, _mm256_permute2f128_ps(tm, tm, 1));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    int mask = _mm256_movemask_ps(hit);
+    closest = mask ? __builtin_ctz(_mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(tm, m, _CMP_EQ_OQ), hit))) : -1;
+    return mask;
+}
+#endif
+
+}
+
+void TriangleBlock::setTriangle(int lane, const std::array<cv::Vec3f, 3> &vertices, bool emissive)
+{
+    // the same values as Triangle::precompute
+    cv::Vec3f e1 = vertices[1] - vertices[0];
+    cv::Vec3f e2 = vertices[2] - vertices[0];
+    cv::Vec3f n = e1.cross(e2);
+    for (int a = 0; a < 3; a++)
+    {
+        v0[a][lane] = vertices[0][a];
+        edge1[a][lane] = e1[a];
+        edge2[a][lane] = e2[a];
+        normal[a][lane] = n[a];
+    }
+    emissiveMask = emissive ? emissiveMask | 1 << lane : emissiveMask & ~(1 << lane);
+}
+
+int TriangleBlock::intersect(const TriangleBlock *blocks, int n, const Ray &ray, float *t, float *u, float *v, int &closest)
+{
+#if ZOE_X86
+    if (n == 2 && zoe::cpuSupportsAVX2())
+    {
+        return intersectAVX2(blocks, ray, t, u, v, closest);
+    }
+    int mask = intersectSSE(blocks[0], ray, t, u, v, closest);
+    if (n == 2)
+    {
+        int second;
+        int secondMask = intersectSSE(blocks[1], ray, t + width, u + width, v + width, second);
+        if (secondMask && (closest < 0 || t[width + second] < t[closest]))
+        {
+            closest = width + second;
+        }
+        mask |= secondMask << width;
+    }
+    return mask;
+#else
+    return intersectScalar(blocks, n, ray, t, u, v, closest);
+#endif
+}
+
+int TriangleBlock::intersectScalar(const TriangleBlock *blocks, int n, const Ray &ray, float *t, float *u, float *v, int &closest)
+{
+    const cv::Vec3f &dir = ray.getDir();
+    int mask = 0;
+    closest = -1;
+    for (int i = 0; i < n * width; i++)
+    {
+        const TriangleBlock &block = blocks[i / width];
+        int lane = i % width;
+        cv::Vec3f p0(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+        cv::Vec3f e1(block.edge1[0][lane], block.edge1[1][lane], block.edge1[2][lane]);
+        cv::Vec3f e2(block.edge2[0][lane], block.edge2[1][lane], block.edge2[2][lane]);
+        cv::Vec3f normal(block.normal[0][lane], block.normal[1][lane], block.normal[2][lane]);
+
+        float det = -dir.dot(normal);
+        float invDet = 1.0f / det;
+        cv::Vec3f s = ray.getOrig() - p0;
+        cv::Vec3f q = s.cross(dir);
+        t[i] = s.dot(normal) * invDet;
+        u[i] = e2.dot(q) * invDet;
+        v[i] = -e1.dot(q) * invDet;
+        if ((det != 0) & (t[i] >= zoe::selfCrossEpsilon) & (t[i] <= ray.getTMax()) & (u[i] >= 0) & (v[i] >= 0) & (u[i] + v[i] <= 1))
+        {
+            mask |= 1 << i;
+            if (closest < 0 || t[i] < t[closest])
+            {
+                closest = i;
+            }
+        }
+    }
+    return mask;
+}
@@ -0,0 +1,40 @@
+#ifndef __COMMON_TRIANGLEBLOCK_H__
+#define __COMMON_TRIANGLEBLOCK_H__
+
+#include <array>
+#include <opencv2/opencv.hpp>
+#include "common/Ray.h"
+
+/**
+ * @brief Four triangles of a BVH leaf stored as SoA, one SIMD lane per triangle, so that a ray
+ *        is tested against all of them at once instead of through one virtual call per triangle.
+ *        Unused lanes stay zero, their determinant is 0 and they never hit.
+ */
+struct alignas(16) TriangleBlock
+{
+    static constexpr int width = 4;
+
+    float v0[3][width] = {};
+    float edge1[3][width] = {};
+    float edge2[3][width] = {};
+    float normal[3][width] = {};
+    int emissiveMask = 0;   // lanes whose triangle emits light
+
+    void setTriangle(int lane, const std::array<cv::Vec3f, 3> &vertices, bool emissive);
+
+    /**
+     * @brief Intersect a ray with the triangles of one or two consecutive blocks, with the
+     *        arithmetic of Triangle::hitTest so that the results agree bit for bit.
+     *        Two blocks are tested together with AVX2 if the CPU has it, otherwise one after another with SSE.
+     * @param n The number of blocks, 1 or 2
+     * @param t u v Distance and barycentric coordinates per lane, lane i of block b at index b * width + i
+     * @param closest The hit lane with the smallest t, the first one on ties
+     * @return The mask of lanes hit
+     */
+    static int intersect(const TriangleBlock *blocks, int n, const Ray &ray, float *t, float *u, float *v, int &closest);
+
+    // the same test one lane after another, used where SSE is not available
+    static int intersectScalar(const TriangleBlock *blocks, int n, const Ray &ray, float *t, float *u, float *v, int &closest);
+};
+
+#endif
@@ -0,0 +1,508 @@
+#include <cstring>
+#include "common/WideBVH.h"
+#include "common/utils.h"
+#include "common/TraversalStats.h"
+#if ZOE_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// 2^e built from the exponent bits, e must lie in the normal float range
+float exp2i(int e)
+{
+    uint32_t bits = static_cast<uint32_t>(e + 127) << 23;
+    float res;
+    std::memcpy(&res, &bits, sizeof(float));
+    return res;
+}
+
+// q * 2^e is exact for 8-bit q, so this rounds the same way with or without FMA contraction
+float dequantize(float origin, uint8_t q, float scale)
+{
+    return origin + q * scale;
+}
+
+template <int N>
+int intersectChildrenScalar(const typename WideBVH<N>::WideBVHNode &node, const float *orig, const float *invDir, const int *dirIsNeg, float tMin, float tMax, float *tEnter)
+{
+    int mask = 0;
+    for (int i = 0; i < N; i++)
+    {
+        float enter = tMin;
+        float exit = tMax;
+        for (int a = 0; a < 3; a++)
+        {
+            float t0 = ((dirIsNeg[a] ? node.bmax[a][i] : node.bmin[a][i]) - orig[a]) * invDir[a];
+            float t1 = ((dirIsNeg[a] ? node.bmin[a][i] : node.bmax[a][i]) - orig[a]) * invDir[a] * AABB::slabExitScale;
+            enter = t0 > enter ? t0 : enter;
+            exit = t1 < exit ? t1 : exit;
+        }
+        tEnter[i] = enter;
+        mask |= (enter <= exit) << i;
+    }
+    return mask;
+}
+
+#if ZOE_X86
+// _mm_max_ps / _mm_min_ps return the second operand on NaN, so the running interval is kept
+int intersectChildrenSSE(const WideBVH<4>::WideBVHNode &node, const float *orig, const float *invDir, const int *dirIsNeg, float tMin, float tMax, float *tEnter)
+{
+    __m128 enter = _mm_set1_ps(tMin);
+    __m128 exit = _mm_set1_ps(tMax);
+    __m128 exitScale = _mm_set1_ps(AABB::slabExitScale);
+    for (int a = 0; a < 3; a++)
+    {
+        __m128 o = _mm_set1_ps(orig[a]);
+        __m128 inv = _mm_set1_ps(invDir[a]);
+        __m128 nearPlane = _mm_load_ps(dirIsNeg[a] ? node.bmax[a] : node.bmin[a]);
+        __m128 farPlane = _mm_load_ps(dirIsNeg[a] ? node.bmin[a] : node.bmax[a]);
+        enter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, o), inv), enter);
+        exit = _mm_min_ps(_mm_mul_ps(_mm_mul_ps(_mm_sub_ps(farPlane, o), inv), exitScale), exit);
+    }
+    _mm_storeu_ps(tEnter, enter);
+    return _mm_movemask_ps(_mm_cmple_ps(enter, exit));
+}
+
+__attribute__((target("avx2")))
+int intersectChildrenAVX2(const WideBVH<8>::WideBVHNode &node, const float *orig, const float *invDir, const int *dirIsNeg, float tMin, float tMax, float *tEnter)
+{
+    __m256 enter = _mm256_set1_ps(tMin);
+    __m256 exit = _mm256_set1_ps(tMax);
+    __m256 exitScale = _mm256_set1_ps(AABB::slabExitScale);
+    for (int a = 0; a < 3; a++)
+    {
+        __m256 o = _mm256_set1_ps(orig[a]);
+        __m256 inv = _mm256_set1_ps(invDir[a]);
+        __m256 nearPlane = _mm256_load_ps(dirIsNeg[a] ? node.bmax[a] : node.bmin[a]);
+        __m256 farPlane = _mm256_load_ps(dirIsNeg[a] ? node.bmin[a] : node.bmax[a]);
+        enter = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearPlane, o), inv), enter);
+        exit = _mm256_min_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(farPlane, o), inv), exitScale), exit);
+    }
+    _mm256_storeu_ps(tEnter, enter);
+    return _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+}
+
+// widens 4 bytes to floats with SSE2 unpacks
+__m128 loadQuantizedSSE(const uint8_t *q)
+{
+    int32_t packed;
+    std::memcpy(&packed, q, sizeof(packed));
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    return _mm_cvtepi32_ps(v);
+}
+
+int intersectChildrenQuantizedSSE(const WideBVH<4>::QuantizedNode &node, const float *orig, const float *invDir, const int *dirIsNeg, float tMin, float tMax, float *tEnter)
+{
+    __m128 enter = _mm_set1_ps(tMin);
+    __m128 exit = _mm_set1_ps(tMax);
+    __m128 exitScale = _mm_set1_ps(AABB::slabExitScale);
+    for (int a = 0; a < 3; a++)
+    {
+        __m128 origin = _mm_set1_ps(node.origin[a]);
+        __m128 scale = _mm_set1_ps(exp2i(node.exponent[a]));
+        __m128 lo = _mm_add_ps(origin, _mm_mul_ps(loadQuantizedSSE(node.qmin[a]), scale));
+        __m128 hi = _mm_add_ps(origin, _mm_mul_ps(loadQuantizedSSE(node.qmax[a]), scale));
+        __m128 o = _mm_set1_ps(orig[a]);
+        __m128 inv = _mm_set1_ps(invDir[a]);
+        __m128 nearPlane = dirIsNeg[a] ? hi : lo;
+        __m128 farPlane = dirIsNeg[a] ? lo : hi;
+        enter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, o), inv), enter);
+        exit = _mm_min_ps(_mm_mul_ps(_mm_mul_ps(_mm_sub_ps(farPlane, o), inv), exitScale), exit);
+    }
+    _mm_storeu_ps(tEnter, enter);
+    return _mm_movemask_ps(_mm_cmple_ps(enter, exit));
+}
+
+__attribute__((target("avx2")))
+int intersectChildrenQuantizedAVX2(const WideBVH<8>::QuantizedNode &node, const float *orig, const float *invDir, const int *dirIsNeg, float tMin, float tMax, float *tEnter)
+{
+    __m256 enter = _mm256_set1_ps(tMin);
+    __m256 exit = _mm256_set1_ps(tMax);
+    __m256 exitScale = _mm256_set1_ps(AABB::slabExitScale);
+    for (int a = 0; a < 3; a++)
+    {
+        __m256 origin = _mm256_set1_ps(node.origin[a]);
+        __m256 scale = _mm256_set1_ps(exp2i(node.exponent[a]));
+        __m256 qmin = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(node.qmin[a]))));
+        __m256 qmax = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(node.qmax[a]))));
+        // no FMA here, the bounds must round exactly like the scalar dequantize
+        __m256 lo = _mm256_add_ps(origin, _mm256_mul_ps(qmin, scale));
+        __m256 hi = _mm256_add_ps(origin, _mm256_mul_ps(qmax, scale));
+        __m256 o = _mm256_set1_ps(orig[a]);
+        __m256 inv = _mm256_set1_ps(invDir[a]);
+        __m256 nearPlane = dirIsNeg[a] ? hi : lo;
+        __m256 farPlane = dirIsNeg[a] ? lo : hi;
+        enter = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearPlane, o), inv), enter);
+        exit = _mm256_min_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(farPlane, o), inv), exitScale), exit);
+    }
+    _mm256_storeu_ps(tEnter, enter);
+    return _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+}
+#endif
+
+}
+
+template <int N>
+WideBVH<N>::WideBVH(const std::shared_ptr<const BVH> &bvh, bool quantized) :
+    m_bvh(bvh)
+{
+    m_useAVX2 = zoe::cpuSupportsAVX2();
+    if (!m_bvh->getNodes().empty())
+    {
+        m_nodes.reserve(m_bvh->getNodes().size() / (N - 1) + 1);
+        collapse(0);
+        m_nodes.shrink_to_fit();
+    }
+    if (quantized)
+    {
+        m_quantizedNodes.resize(m_nodes.size());
+#if ENABLE_OPENMP
+        #pragma omp parallel for
+#endif
+        for (size_t i = 0; i < m_nodes.size(); i++)
+        {
+            m_quantizedNodes[i] = quantize(m_nodes[i]);
+        }
+        std::vector<WideBVHNode>().swap(m_nodes);
+    }
+}
+
+template <int N>
+typename WideBVH<N>::QuantizedNode WideBVH<N>::quantize(const WideBVHNode &node)
+{
+    QuantizedNode res;
+    std::memset(&res, 0, sizeof(QuantizedNode));
+    for (int i = 0; i < N; i++)
+    {
+        res.child[i] = node.child[i];
+        res.count[i] = node.count[i];
+    }
+
+    for (int a = 0; a < 3; a++)
+    {
+        // the grid spans the union of the children, empty slots are skipped by their count
+        float min = std::numeric_limits<float>::infinity();
+        float max = -std::numeric_limits<float>::infinity();
+        for (int i = 0; i < N; i++)
+        {
+            if (node.count[i] >= 0)
+            {
+                min = std::min(min, node.bmin[a][i]);
+                max = std::max(max, node.bmax[a][i]);
+            }
+        }
+
+        // smallest power of two cell that covers the extent with 255 steps
+        int e = -126;
+        if (max > min)
+        {
+            e = std::clamp(static_cast<int>(std::ceil(std::log2((max - min) / 255))), -126, 127);
+        }
+        while (e < 127 && dequantize(min, 255, exp2i(e)) < max)
+        {
+            e++;
+        }
+        float scale = exp2i(e);
+        res.origin[a] = min;
+        res.exponent[a] = e;
+
+        for (int i = 0; i < N; i++)
+        {
+            if (node.count[i] < 0)
+            {
+                continue;
+            }
+            int qmin = std::clamp(static_cast<int>(std::floor((node.bmin[a][i] - min) / scale)), 0, 255);
+            int qmax = std::clamp(static_cast<int>(std::ceil((node.bmax[a][i] - min) / scale)), 0, 255);
+            // the divisions round, step outwards until the cells contain the exact bounds
+            while (qmin > 0 && dequantize(min, qmin, scale) > node.bmin[a][i])
+            {
+                qmin--;
+            }
+            while (qmax < 255 && dequantize(min, qmax, scale) < node.bmax[a][i])
+            {
+                qmax++;
+            }
+            res.qmin[a][i] = qmin;
+            res.qmax[a][i] = qmax;
+        }
+    }
+    return res;
+}
+
+template <int N>
+size_t WideBVH<N>::getMemoryBytes() const
+{
+    return m_nodes.capacity() * sizeof(WideBVHNode) + m_quantizedNodes.capacity() * sizeof(QuantizedNode);
+}
+
+template <int N>
+int WideBVH<N>::collapse(int binaryNode)
+{
+    const std::vector<BVH::LinearBVHNode> &nodes = m_bvh->getNodes();
+
+    // open the largest interior child until the node is full
+    std::vector<int> children;
+    if (nodes[binaryNode].nPrimitives > 0)
+    {
+        children.push_back(binaryNode);
+    }
+    else
+    {
+        children.push_back(binaryNode + 1);
+        children.push_back(nodes[binaryNode].secondChildOffset);
+    }
+    while (static_cast<int>(children.size()) < N)
+    {
+        int best = -1;
+        float bestArea = -1;
+        for (size_t i = 0; i < children.size(); i++)
+        {
+            const BVH::LinearBVHNode &child = nodes[children[i]];
+            if (child.nPrimitives == 0 && child.aabb.getSurfaceArea() > bestArea)
+            {
+                best = i;
+                bestArea = child.aabb.getSurfaceArea();
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        int opened = children[best];
+        children[best] = opened + 1;
+        children.push_back(nodes[opened].secondChildOffset);
+    }
+
+    int nodeIndex = m_nodes.size();
+    m_nodes.emplace_back();
+    for (int i = 0; i < N; i++)
+    {
+        WideBVHNode &node = m_nodes[nodeIndex];
+        if (i >= static_cast<int>(children.size()))
+        {
+            // an empty box never passes the slab test
+            for (int a = 0; a < 3; a++)
+            {
+                node.bmin[a][i] = std::numeric_limits<float>::infinity();
+                node.bmax[a][i] = -std::numeric_limits<float>::infinity();
+            }
+            node.child[i] = 0;
+            node.count[i] = -1;
+            continue;
+        }
+
+        const BVH::LinearBVHNode &child = nodes[children[i]];
+        for (int a = 0; a < 3; a++)
+        {
+            node.bmin[a][i] = child.aabb.getMin()[a];
+            node.bmax[a][i] = child.aabb.getMax()[a];
+        }
+        if (child.nPrimitives > 0)
+        {
+            node.child[i] = child.primitivesOffset;
+            node.count[i] = child.nPrimitives;
+        }
+        else
+        {
+            // m_nodes may be reallocated by the recursive call
+            int childIndex = collapse(children[i]);
+            m_nodes[nodeIndex].child[i] = childIndex;
+            m_nodes[nodeIndex].count[i] = 0;
+        }
+    }
+    return nodeIndex;
+}
+
+template <int N>
+typename WideBVH<N>::WideRay WideBVH<N>::makeWideRay(const Ray &ray)
+{
+    WideRay wideRay;
+    for (int a = 0; a < 3; a++)
+    {
+        wideRay.orig[a] = ray.getOrig()[a];
+        wideRay.invDir[a] = ray.getInvDir()[a];
+        wideRay.dirIsNeg[a] = ray.getDirIsNeg()[a];
+    }
+    wideRay.tMin = ray.getTMin();
+    return wideRay;
+}
+
+template <int N>
+int WideBVH<N>::intersectChildren(const WideBVHNode &node, const WideRay &ray, float tMax, float *tEnter) const
+{
+    BVH_STATS_ADD(nodesVisited, 1);
+    BVH_STATS_ADD(boxesTested, N);
+#if ZOE_X86
+    if constexpr (N == 4)
+    {
+        return intersectChildrenSSE(node, ray.orig, ray.invDir, ray.dirIsNeg, ray.tMin, tMax, tEnter);
+    }
+    if constexpr (N == 8)
+    {
+        if (m_useAVX2)
+        {
+            return intersectChildrenAVX2(node, ray.orig, ray.invDir, ray.dirIsNeg, ray.tMin, tMax, tEnter);
+        }
+    }
+#endif
+    return intersectChildrenScalar<N>(node, ray.orig, ray.invDir, ray.dirIsNeg, ray.tMin, tMax, tEnter);
+}
+
+template <int N>
+int WideBVH<N>::intersectChildren(const QuantizedNode &node, const WideRay &ray, float tMax, float *tEnter) const
+{
+#if ZOE_X86
+    if constexpr (N == 4)
+    {
+        BVH_STATS_ADD(nodesVisited, 1);
+        BVH_STATS_ADD(boxesTested, N);
+        return intersectChildrenQuantizedSSE(node, ray.orig, ray.invDir, ray.dirIsNeg, ray.tMin, tMax, tEnter);
+    }
+    if constexpr (N == 8)
+    {
+        if (m_useAVX2)
+        {
+            BVH_STATS_ADD(nodesVisited, 1);
+            BVH_STATS_ADD(boxesTested, N);
+            return intersectChildrenQuantizedAVX2(node, ray.orig, ray.invDir, ray.dirIsNeg, ray.tMin, tMax, tEnter);
+        }
+    }
+#endif
+    WideBVHNode bounds;
+    for (int a = 0; a < 3; a++)
+    {
+        float scale = exp2i(node.exponent[a]);
+        for (int i = 0; i < N; i++)
+        {
+            bounds.bmin[a][i] = dequantize(node.origin[a], node.qmin[a][i], scale);
+            bounds.bmax[a][i] = dequantize(node.origin[a], node.qmax[a][i], scale);
+        }
+    }
+    return intersectChildren(bounds, ray, tMax, tEnter);
+}
+
+template <int N>
+std::optional<HitPayload> WideBVH<N>::intersect(const Ray &ray) const
+{
+    return isQuantized() ? intersect(m_quantizedNodes, ray) : intersect(m_nodes, ray);
+}
+
+template <int N>
+bool WideBVH<N>::occluded(const Ray &ray, float tMax) const
+{
+    return isQuantized() ? occluded(m_quantizedNodes, ray, tMax) : occluded(m_nodes, ray, tMax);
+}
+
+template <int N>
+template <typename Node>
+std::optional<HitPayload> WideBVH<N>::intersect(const std::vector<Node> &nodes, const Ray &ray) const
+{
+    if (nodes.empty())
+    {
+        return std::nullopt;
+    }
+
+    BVH_STATS_ADD(rays, 1);
+    Ray r = ray;
+    BVH::ClosestHit closest;
+    WideRay wideRay = makeWideRay(r);
+    StackEntry toVisit[stackSize];
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = { 0, 0 };
+    while (toVisitOffset > 0)
+    {
+        StackEntry entry = toVisit[--toVisitOffset];
+        if (entry.tEnter > r.getTMax())
+        {
+            continue;
+        }
+
+        const Node &node = nodes[entry.node];
+        float tEnter[N];
+        int mask = intersectChildren(node, wideRay, r.getTMax(), tEnter);
+
+        // sort the hit children front to back
+        int order[N];
+        int nHit = 0;
+        for (int i = 0; i < N; i++)
+        {
+            if ((mask >> i & 1) && node.count[i] >= 0)
+            {
+                int j = nHit++;
+                for (; j > 0 && tEnter[order[j - 1]] > tEnter[i]; j--)
+                {
+                    order[j] = order[j - 1];
+                }
+                order[j] = i;
+            }
+        }
+
+        // leaves shrink tMax right away, interior children are pushed far to near
+        for (int k = 0; k < nHit; k++)
+        {
+            int i = order[k];
+            if (node.count[i] > 0 && tEnter[i] <= r.getTMax())
+            {
+                m_bvh->intersectLeaf(node.child[i], node.count[i], r, closest);
+            }
+        }
+        for (int k = nHit - 1; k >= 0; k--)
+        {
+            int i = order[k];
+            if (node.count[i] == 0)
+            {
+                toVisit[toVisitOffset++] = { node.child[i], tEnter[i] };
+            }
+        }
+    }
+    return BVH::makeHit(ray, closest);
+}
+
+template <int N>
+template <typename Node>
+bool WideBVH<N>::occluded(const std::vector<Node> &nodes, const Ray &ray, float tMax) const
+{
+    if (nodes.empty())
+    {
+        return false;
+    }
+
+    BVH_STATS_ADD(rays, 1);
+    Ray r = ray;
+    r.setTMax(tMax);
+    WideRay wideRay = makeWideRay(r);
+    int toVisit[stackSize];
+    int toVisitOffset = 0;
+    toVisit[toVisitOffset++] = 0;
+    while (toVisitOffset > 0)
+    {
+        const Node &node = nodes[toVisit[--toVisitOffset]];
+        float tEnter[N];
+        int mask = intersectChildren(node, wideRay, tMax, tEnter);
+        for (int i = 0; i < N; i++)
+        {
+            if (!(mask >> i & 1) || node.count[i] < 0)
+            {
+                continue;
+            }
+            if (node.count[i] > 0)
+            {
+                if (m_bvh->occludedLeaf(node.child[i], node.count[i], r))
+                {
+                    return true;
+                }
+            }
+            else
+            {
+                toVisit[toVisitOffset++] = node.child[i];
+            }
+        }
+    }
+    return false;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
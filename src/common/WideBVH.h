@@ -0,0 +1,92 @@
+#ifndef __COMMON_WIDEBVH_H__
+#define __COMMON_WIDEBVH_H__
+
+#include <memory>
+#include <cstdint>
+#include "common/BVH.h"
+
+/**
+ * @brief N-ary BVH collapsed from a binary BVH, N = 4 uses SSE and N = 8 uses AVX2
+ *        to test all child boxes of a node at once. Leaves are the leaves of the binary BVH.
+ *        The nodes can be stored quantized, with child bounds as 8-bit offsets on a per-node grid.
+ */
+template <int N>
+class WideBVH
+{
+public:
+    struct alignas(32) WideBVHNode
+    {
+        float bmin[3][N];   // child bounds, one SIMD lane per child
+        float bmax[3][N];
+        int child[N];       // interior child: node index, leaf child: primitivesOffset
+        int count[N];       // interior child: 0, leaf child: number of primitives, empty slot: -1
+    };
+
+    /**
+     * @brief Compressed WideBVHNode. Child bounds are grid cells origin + q * 2^exponent,
+     *        rounded outwards so that the dequantized boxes always contain the exact ones.
+     */
+    struct alignas(16) QuantizedNode
+    {
+        float origin[3];
+        int8_t exponent[3];
+        uint8_t pad;
+        uint8_t qmin[3][N];
+        uint8_t qmax[3][N];
+        int child[N];
+        int16_t count[N];
+    };
+
+private:
+    // ray data broadcast into the slab tests
+    struct WideRay
+    {
+        float orig[3];
+        float invDir[3];
+        int dirIsNeg[3];
+        float tMin;
+    };
+
+    struct StackEntry
+    {
+        int node;
+        float tEnter;
+    };
+
+    static constexpr int stackSize = 64 * N;
+
+    std::shared_ptr<const BVH> m_bvh;
+    std::vector<WideBVHNode> m_nodes;
+    // replaces m_nodes when the hierarchy is quantized
+    std::vector<QuantizedNode> m_quantizedNodes;
+    bool m_useAVX2 = false;
+
+    int collapse(int binaryNode);
+    static QuantizedNode quantize(const WideBVHNode &node);
+    int intersectChildren(const WideBVHNode &node, const WideRay &ray, float tMax, float *tEnter) const;
+    int intersectChildren(const QuantizedNode &node, const WideRay &ray, float tMax, float *tEnter) const;
+
+    template <typename Node>
+    std::optional<HitPayload> intersect(const std::vector<Node> &nodes, const Ray &ray) const;
+    template <typename Node>
+    bool occluded(const std::vector<Node> &nodes, const Ray &ray, float tMax) const;
+
+    static WideRay makeWideRay(const Ray &ray);
+
+public:
+    WideBVH(const std::shared_ptr<const BVH> &bvh, bool quantized = false);
+
+    const std::vector<WideBVHNode> &getNodes() const { return m_nodes; }
+    const std::vector<QuantizedNode> &getQuantizedNodes() const { return m_quantizedNodes; }
+    bool isQuantized() const { return !m_quantizedNodes.empty(); }
+    size_t getNodeCount() const { return isQuantized() ? m_quantizedNodes.size() : m_nodes.size(); }
+    size_t getMemoryBytes() const;
+
+    std::optional<HitPayload> intersect(const Ray &ray) const;
+    bool occluded(const Ray &ray, float tMax) const;
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
+
+#endif
@@ -95,6 +95,16 @@ float randomFloat()
     return dis(gen);
 }
 
+bool cpuSupportsAVX2()
+{
+#if ZOE_X86
+    static bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
 cv::Vec3f localToWorld(const cv::Vec3f &dir, const cv::Vec3f &normal)
 {
     cv::Vec3f c;
@@ -160,9 +170,28 @@ std::string getLastFile(const std::string &directory)
     return res;
 }
 
+float powerHeuristic(float pdf, float otherPdf)
+{
+    float a = pdf * pdf;
+    float b = otherPdf * otherPdf;
+    return a + b > 0 ? a / (a + b) : 0;
+}
+
 float roundToUnit(float x)
 {
     return x - std::floor(x);
 }
 
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
 }
\ No newline at end of file
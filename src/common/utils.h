@@ -2,6 +2,7 @@
 #define __COMMON_UTILS_H__
 
 #include <cmath>
+#include <cstdint>
 #include <optional>
 #include <filesystem>
 #include <opencv2/opencv.hpp>
@@ -10,6 +11,18 @@
 
 #define OUTPUT_DEBUG_LOG false
 #define ENABLE_OPENMP true
+#define ENABLE_BVH_STATS false
+// primary rays traced together per tile: 4, 8 or 16
+#define RAY_PACKET_SIZE 8
+// watertight ray/triangle test, slower but closes the cracks between adjacent triangles
+#define WATERTIGHT_TRIANGLE_TEST false
+
+// SSE2 is part of x86-64, other targets use the scalar kernels
+#if defined(__x86_64__) || defined(__i386__)
+#define ZOE_X86 1
+#else
+#define ZOE_X86 0
+#endif
 
 namespace zoe {
 
@@ -40,6 +53,17 @@ float fresnel(const cv::Vec3f &viewDir, const cv::Vec3f &normal, float ior);
 
 float randomFloat();
 
+/**
+ * @brief Power heuristic (beta = 2) weight of a sample drawn with pdf, when otherPdf could also have produced it.
+ *        Both pdfs must be in the same measure.
+ */
+float powerHeuristic(float pdf, float otherPdf);
+
+/**
+ * @brief Runtime check for the AVX2 instruction set
+ */
+bool cpuSupportsAVX2();
+
 cv::Vec3f localToWorld(const cv::Vec3f &dir, const cv::Vec3f &normal);
 
 void updateProgress(float progress);
@@ -50,6 +74,20 @@ std::string getLastFile(const std::string &directory);
 
 float roundToUnit(float x);
 
+const uint64_t fnvOffsetBasis = 14695981039346656037ull;
+
+/**
+ * @brief 64-bit FNV-1a hash of a byte range
+ * @param seed the hash of the preceding data, used to chain several ranges
+ */
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed = fnvOffsetBasis);
+
+template <typename T>
+uint64_t hashValue(const T &value, uint64_t seed = fnvOffsetBasis)
+{
+    return hashBytes(&value, sizeof(T), seed);
+}
+
 }
 
 #endif
\ No newline at end of file
@@ -1,7 +1,6 @@
 #ifndef __OBJECTS_HITPAYLOAD_H__
 #define __OBJECTS_HITPAYLOAD_H__
 
-#include <memory>
 #include <utility>
 #include <opencv2/opencv.hpp>
 
@@ -10,12 +9,15 @@ class Object;
 struct HitPayload
 {
     cv::Vec2f uv;                         // interpolated coefficients
-    std::shared_ptr<const Object> hitObj; // hit object
+    const Object *hitObj;                 // hit object, owned by the scene, not by the hit
     float dist;                           // t in light equation: r(t) = o + t * d
     cv::Vec3f emission;                   // emission intensity
     cv::Vec3f point;                      // sample point
+    cv::Vec3f normal;                     // surface normal at point
+    cv::Vec2f st;                         // texture coordinates at point
+    int primIndex = 0;                    // primitive of hitObj, e.g. the face of a mesh
 
-    HitPayload(cv::Vec2f uv = 0, std::shared_ptr<const Object> hitObj = nullptr, float dist = 0, cv::Vec3f emission = cv::Vec3f(0, 0, 0))
+    HitPayload(cv::Vec2f uv = 0, const Object *hitObj = nullptr, float dist = 0, cv::Vec3f emission = cv::Vec3f(0, 0, 0))
         : uv(uv), hitObj(hitObj), dist(dist), emission(emission)
     {
 
@@ -27,6 +29,19 @@ struct HitPayload
     }
 };
 
+/**
+ * @brief A hit found during traversal before it is known to be the closest,
+ *        only what the closest-hit test needs
+ */
+struct PrimitiveHit
+{
+    float t = 0;            // distance along the ray
+    float u = 0;            // barycentric coordinates, if any
+    float v = 0;
+    bool emissive = false;  // emitters win near ties
+    int inner = -1;         // Instance: the primitive hit in its bottom-level BVH, an index into BVH::getPrimitives
+};
+
 template <size_t I>
 auto get(const HitPayload &payload)
 {
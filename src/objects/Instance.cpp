@@ -0,0 +1,116 @@
+#include "objects/Instance.h"
+#include "common/utils.h"
+
+Instance::Instance(std::shared_ptr<const BVH> bvh, const cv::Matx44f &transform) :
+    m_bvh(bvh),
+    m_transform(transform)
+{
+    m_linear = transform.get_minor<3, 3>(0, 0);
+    m_invLinear = m_linear.inv();
+    m_translation = cv::Vec3f(transform(0, 3), transform(1, 3), transform(2, 3));
+    for (const auto &object : bvh->getObjects())
+    {
+        if (dynamic_cast<const Instance *>(object.get()) != nullptr)
+        {
+            throw std::runtime_error("Instance: the bottom-level BVH cannot contain instances.");
+        }
+    }
+}
+
+std::pair<Ray, float> Instance::toObject(const Ray &ray) const
+{
+    cv::Vec3f orig = m_invLinear * (ray.getOrig() - m_translation);
+    cv::Vec3f dir = m_invLinear * ray.getDir();
+    // the object space ray is normalized again, distances scale by the length of dir
+    float scale = cv::norm(dir);
+    return std::make_pair(Ray(orig, dir, ray.getTMax() * scale), scale);
+}
+
+cv::Vec3f Instance::transformPoint(const cv::Vec3f &point) const
+{
+    return m_linear * point + m_translation;
+}
+
+std::optional<HitPayload> Instance::intersect(const Ray &ray) const
+{
+    PrimitiveHit hit;
+    if (!hitPrimitive(ray, 0, hit))
+    {
+        return std::nullopt;
+    }
+    return makePrimitiveHit(ray, 0, hit);
+}
+
+bool Instance::hitPrimitive(const Ray &ray, int prim, PrimitiveHit &hit) const
+{
+    auto [objectRay, scale] = toObject(ray);
+    BVH::ClosestHit closest = m_bvh->intersectClosest(objectRay);
+    if (closest.prim == nullptr)
+    {
+        return false;
+    }
+    hit = closest.hit;
+    hit.t /= scale;
+    hit.inner = closest.prim - m_bvh->getPrimitives().data();
+    return true;
+}
+
+HitPayload Instance::makePrimitiveHit(const Ray &ray, int prim, const PrimitiveHit &hit) const
+{
+    // the recorded inner primitive builds its payload directly, tMax of the object ray still covers the hit
+    auto [objectRay, scale] = toObject(ray);
+    BVH::ClosestHit closest;
+    closest.prim = &m_bvh->getPrimitives()[hit.inner];
+    closest.hit = hit;
+    closest.hit.t = hit.t * scale;
+    closest.rayTMax = objectRay.getTMax();
+    HitPayload payload = BVH::makeHit(objectRay, closest).value();
+
+    payload.dist = hit.t;
+    payload.point = transformPoint(payload.point);
+    // normals transform by the inverse transpose
+    payload.normal = cv::normalize(m_invLinear.t() * payload.normal);
+    return payload;
+}
+
+bool Instance::occluded(const Ray &ray) const
+{
+    auto [objectRay, scale] = toObject(ray);
+    return m_bvh->occluded(objectRay, objectRay.getTMax());
+}
+
+AABB Instance::getAABB() const
+{
+    if (m_bvh->getNodes().empty())
+    {
+        return AABB();
+    }
+
+    const AABB &bound = m_bvh->getNodes()[0].aabb;
+    AABB res;
+    for (int i = 0; i < 8; i++)
+    {
+        cv::Vec3f corner(
+            (i & 1) ? bound.getMax()[0] : bound.getMin()[0],
+            (i & 2) ? bound.getMax()[1] : bound.getMin()[1],
+            (i & 4) ? bound.getMax()[2] : bound.getMin()[2]
+        );
+        res = res + transformPoint(corner);
+    }
+    return res;
+}
+
+cv::Vec3f Instance::getNormal(const cv::Vec3f &point) const
+{
+    throw std::runtime_error("Instance has no normal of its own, use HitPayload::normal.");
+}
+
+HitPayload Instance::samplePoint() const
+{
+    throw std::runtime_error("Instances cannot be sampled as lights.");
+}
+
+uint64_t Instance::getGeometryHash() const
+{
+    return zoe::hashValue(m_transform, m_bvh->getHash());
+}
@@ -0,0 +1,53 @@
+#ifndef __OBJECTS_INSTANCE_H__
+#define __OBJECTS_INSTANCE_H__
+
+#include <memory>
+#include "common/BVH.h"
+#include "objects/Object.h"
+
+/**
+ * @brief A placement of a shared mesh BVH under an affine transform.
+ *        Rays are moved into object space, so every copy reuses the same bottom-level BVH.
+ *        The hit object of a payload is the primitive inside the mesh, which carries the material.
+ *        A hit records the primitive of the bottom-level BVH, so the payload is built without a second traversal;
+ *        the bottom-level BVH therefore cannot hold instances itself.
+ */
+class Instance : public Object
+{
+private:
+    std::shared_ptr<const BVH> m_bvh;
+    cv::Matx44f m_transform;    // object to world
+    cv::Matx33f m_linear;
+    cv::Matx33f m_invLinear;
+    cv::Vec3f m_translation;
+
+    // returns the object space ray and the length of a unit world direction in object space
+    std::pair<Ray, float> toObject(const Ray &ray) const;
+    cv::Vec3f transformPoint(const cv::Vec3f &point) const;
+
+public:
+    /**
+     * @param bvh The bottom-level BVH of the mesh
+     * @param transform Object to world transform, the last row is ignored
+     */
+    Instance(std::shared_ptr<const BVH> bvh, const cv::Matx44f &transform);
+
+    virtual std::optional<HitPayload> intersect(const Ray &ray) const override;
+    virtual bool occluded(const Ray &ray) const override;
+    virtual bool hitPrimitive(const Ray &ray, int prim, PrimitiveHit &hit) const override;
+    virtual HitPayload makePrimitiveHit(const Ray &ray, int prim, const PrimitiveHit &hit) const override;
+
+    virtual AABB getAABB() const override;
+
+    // instances are never sampled as lights, the normal comes with the hit payload
+    virtual cv::Vec3f getNormal(const cv::Vec3f &point) const override;
+    virtual float getArea() const override { return 0; }
+    virtual HitPayload samplePoint() const override;
+    virtual uint64_t getGeometryHash() const override;
+    virtual cv::Vec2f getTexCoords(const cv::Vec2f &uv) const override { return uv; }
+
+    const std::shared_ptr<const BVH> &getBVH() const { return m_bvh; }
+    const cv::Matx44f &getTransform() const { return m_transform; }
+};
+
+#endif
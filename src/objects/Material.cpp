@@ -1,3 +1,4 @@
+#include <algorithm>
 #include "common/utils.h"
 #include "objects/Material.h"
 
@@ -13,90 +14,211 @@ Material::Material(MaterialType materialType, cv::Vec3f emission, cv::Vec3f kd,
 
 }
 
-float Material::pdf(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo)
+namespace {
+
+// DIFFUSE_AND_REFRACTION: chance of sampling the diffuse lobe instead of the refraction
+constexpr float diffuseProbability = 0.1f;
+
+// cosine-weighted around the normal, pdf cos / pi
+cv::Vec3f sampleCosine(const cv::Vec3f &normal)
+{
+    float x = zoe::randomFloat();
+    float y = zoe::randomFloat();
+    float r = std::sqrt(x);
+    float phi = 2 * M_PI * y;
+    cv::Vec3f localRay(r * std::cos(phi), r * std::sin(phi), std::sqrt(1 - x));
+    return zoe::localToWorld(localRay, normal);
+}
+
+// uniform over the hemisphere around the normal
+cv::Vec3f sampleUniform(const cv::Vec3f &normal)
+{
+    float x = zoe::randomFloat();
+    float y = zoe::randomFloat();
+    float z = std::fabs(1 - 2 * x);
+    float r = std::sqrt(1 - z * z);
+    float phi = 2 * M_PI * y;
+    cv::Vec3f localRay(r * std::cos(phi), r * std::sin(phi), z);
+    return zoe::localToWorld(localRay, normal);
+}
+
+// the half vector is drawn with pdf (n + 1) / 2pi * cos^n around the normal, wo is wi mirrored about it
+float phongLobePdf(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo, float exponent)
+{
+    cv::Vec3f h = cv::normalize(wo - wi);
+    float cosH = h.dot(normal);
+    float woDotH = wo.dot(h);
+    if (wo.dot(normal) <= 0 || cosH <= 0 || woDotH <= 0)
+    {
+        return 0;
+    }
+    return (exponent + 1) * std::pow(cosH, exponent) / (8 * M_PI * woDotH);
+}
+
+cv::Vec3f transmission(const cv::Vec3f &tr, float kt, float cosTheta)
+{
+    cv::Vec3f res(kt / -cosTheta, kt / -cosTheta, kt / -cosTheta);
+    if (tr != cv::Vec3f(0, 0, 0))
+    {
+        return res.mul(tr);
+    }
+    return res;
+}
+
+}
+
+float Material::fresnel(const cv::Vec3f &normal, const cv::Vec3f &wi) const
 {
+    switch (materialType)
+    {
+        case MaterialType::REFLECTION:
+        case MaterialType::REFLECTION_AND_REFRACTION:
+        case MaterialType::DIFFUSE_AND_REFRACTION:
+            return zoe::fresnel(wi, normal, ior);
+        default:
+            return 0;
+    }
+}
+
+BSDFSample Material::sample(const cv::Vec3f &normal, const cv::Vec3f &wi) const
+{
+    BSDFSample res;
+    float fr = fresnel(normal, wi);
     switch (materialType)
     {
         case MaterialType::DIFFUSE_AND_GLOSSY:
         {
-            return wo.dot(normal) > 0.0f ? 0.5f / M_PI : 0.0f;
+            res.dir = sampleCosine(normal);
+            res.lobes = BSDFSample::DIFFUSE;
+            break;
         }
         case MaterialType::REFLECTION:
         {
-            return wo.dot(normal) > 0.0f ? 1.0f : 0.0f;
+            res.dir = zoe::reflect(wi, normal);
+            res.lobes = BSDFSample::SPECULAR;
+            break;
         }
         case MaterialType::REFLECTION_AND_REFRACTION:
         {
-            float fr = zoe::fresnel(wi, normal, ior);
-            return wo.dot(normal) > 0.0f ? fr : 1.0f - fr;
+            if (zoe::randomFloat() < fr)
+            {
+                res.dir = zoe::reflect(wi, normal);
+                res.lobes = BSDFSample::SPECULAR;
+            }
+            else
+            {
+                res.dir = zoe::refract(wi, normal, ior);
+                res.lobes = BSDFSample::SPECULAR | BSDFSample::TRANSMISSION;
+            }
+            break;
         }
         case MaterialType::DIFFUSE_AND_REFLECTION:
         {
-            float cosTheta = wo.dot(normal);
-            return cosTheta > 0.0f ? 0.5f / M_PI : 0.0f;
+            float cosH = std::pow(zoe::randomFloat(), 1 / (specularExp + 1));
+            float sinH = std::sqrt(std::max(0.0f, 1 - cosH * cosH));
+            float phi = 2 * M_PI * zoe::randomFloat();
+            cv::Vec3f h = zoe::localToWorld(cv::Vec3f(sinH * std::cos(phi), sinH * std::sin(phi), cosH), normal);
+            res.dir = zoe::reflect(wi, h);
+            res.lobes = BSDFSample::GLOSSY;
+            break;
         }
         case MaterialType::DIFFUSE_AND_REFRACTION:
         {
-            float fr = zoe::fresnel(wi, normal, ior);
-            return wo.dot(normal) > 0.0f ? fr : 1.0f - fr;
+            if (zoe::randomFloat() < diffuseProbability)
+            {
+                res.dir = sampleUniform(normal);
+                res.lobes = BSDFSample::DIFFUSE;
+            }
+            else
+            {
+                res.dir = zoe::refract(wi, normal, ior);
+                res.lobes = BSDFSample::SPECULAR | BSDFSample::TRANSMISSION;
+            }
+            break;
         }
     }
-    throw std::runtime_error("Unsupported material type.");
+    res.dir = cv::normalize(res.dir);
+    res.value = eval(normal, wi, res.dir, fr);
+    res.pdf = pdf(normal, wi, res.dir, fr);
+    return res;
 }
 
-cv::Vec3f Material::sampleDir(const cv::Vec3f &normal, const cv::Vec3f &wi) const
+cv::Vec3f Material::eval(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo) const
 {
+    return eval(normal, wi, wo, fresnel(normal, wi));
+}
+
+float Material::pdf(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo) const
+{
+    return pdf(normal, wi, wo, fresnel(normal, wi));
+}
+
+cv::Vec3f Material::eval(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo, float fr) const
+{
+    float cosTheta = wo.dot(normal);
     switch (materialType)
     {
-        case Material::MaterialType::DIFFUSE_AND_GLOSSY:
-        {
-            float x = zoe::randomFloat();
-            float y = zoe::randomFloat();
-            float z = std::fabs(1 - 2 * x);
-            float r = std::sqrt(1 - z * z);
-            float phi = 2 * M_PI * y;
-            cv::Vec3f localRay(r * std::cos(phi), r * std::sin(phi), z);
-            return zoe::localToWorld(localRay, normal);
-        }
-        case Material::MaterialType::REFLECTION:
+        case MaterialType::DIFFUSE_AND_GLOSSY:
         {
-            return zoe::reflect(wi, normal);
+            return cosTheta > 0 ? cv::Vec3f(kd / M_PI) : cv::Vec3f(0, 0, 0);
         }
-        case Material::MaterialType::REFLECTION_AND_REFRACTION:
+        case MaterialType::REFLECTION:
         {
-            float fr = zoe::fresnel(wi, normal, ior);
-            if (zoe::randomFloat() < fr)
+            if (cosTheta < 0.001)
             {
-                return zoe::reflect(wi, normal);
+                return cv::Vec3f(0, 0, 0);
             }
-            else
+            return cv::Vec3f(fr / cosTheta, fr / cosTheta, fr / cosTheta);
+        }
+        case MaterialType::REFLECTION_AND_REFRACTION:
+        {
+            if (cosTheta > 0)
             {
-                return zoe::refract(wi, normal, ior);
+                return cv::Vec3f(fr / cosTheta, fr / cosTheta, fr / cosTheta);
             }
+            return cosTheta < 0 ? transmission(tr, 1 - fr, cosTheta) : cv::Vec3f(0, 0, 0);
         }
-        case Material::MaterialType::DIFFUSE_AND_REFLECTION:
+        case MaterialType::DIFFUSE_AND_REFLECTION:
         {
-            float x = zoe::randomFloat();
-            float y = zoe::randomFloat();
-            float z = std::fabs(1 - 2 * x);
-            float r = std::sqrt(1 - z * z);
-            float phi = 2 * M_PI * y;
-            cv::Vec3f localRay(r * std::cos(phi), r * std::sin(phi), z);
-            return zoe::localToWorld(localRay, normal);
+            return cosTheta > 0 ? specularBRDF(normal, wi, wo) : cv::Vec3f(0, 0, 0);
         }
-        case Material::MaterialType::DIFFUSE_AND_REFRACTION:
+        case MaterialType::DIFFUSE_AND_REFRACTION:
         {
-            if (zoe::randomFloat() > 0.9)
+            if (cosTheta > 0)
             {
-                float x = zoe::randomFloat();
-                float y = zoe::randomFloat();
-                float z = std::fabs(1 - 2 * x);
-                float r = std::sqrt(1 - z * z);
-                float phi = 2 * M_PI * y;
-                cv::Vec3f localRay(r * std::cos(phi), r * std::sin(phi), z);
-                return zoe::localToWorld(localRay, normal);
+                return kd / M_PI;
             }
-            return zoe::refract(wi, normal, ior);
+            return cosTheta < 0 ? transmission(tr, 1 - fr, cosTheta) : cv::Vec3f(0, 0, 0);
+        }
+    }
+    throw std::runtime_error("Unsupported material type.");
+}
+
+float Material::pdf(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo, float fr) const
+{
+    float cosTheta = wo.dot(normal);
+    switch (materialType)
+    {
+        case MaterialType::DIFFUSE_AND_GLOSSY:
+        {
+            return cosTheta > 0.0f ? cosTheta / M_PI : 0.0f;
+        }
+        case MaterialType::REFLECTION:
+        {
+            return cosTheta > 0.0f ? 1.0f : 0.0f;
+        }
+        case MaterialType::DIFFUSE_AND_REFLECTION:
+        {
+            return phongLobePdf(normal, wi, wo, specularExp);
+        }
+        case MaterialType::REFLECTION_AND_REFRACTION:
+        {
+            return cosTheta > 0.0f ? fr : 1.0f - fr;
+        }
+        case MaterialType::DIFFUSE_AND_REFRACTION:
+        {
+            // sample picks the uniform hemisphere with probability diffuseProbability, otherwise the refraction
+            return cosTheta > 0.0f ? diffuseProbability / (2 * M_PI) : 1.0f - diffuseProbability;
         }
     }
     throw std::runtime_error("Unsupported material type.");
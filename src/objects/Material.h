@@ -3,6 +3,25 @@
 
 #include <opencv2/opencv.hpp>
 
+/**
+ * @brief A direction drawn from a material together with everything the integrator needs about it
+ */
+struct BSDFSample
+{
+    enum Lobe
+    {
+        DIFFUSE = 1,
+        GLOSSY = 2,
+        SPECULAR = 4,       // a delta lobe, its pdf is not a density
+        TRANSMISSION = 8
+    };
+
+    cv::Vec3f dir;          // the sampled outgoing direction, normalized
+    cv::Vec3f value;        // the BSDF for dir
+    float pdf = 0;          // 0 if no direction could be sampled
+    int lobes = 0;          // the lobes dir was sampled from
+};
+
 class Material
 {
 public:
@@ -14,6 +33,9 @@ public:
         DIFFUSE_AND_REFLECTION,
         DIFFUSE_AND_REFRACTION
     };
+    // number of MaterialType values, e.g. for per-type tables
+    static constexpr int materialTypeCount = 5;
+    static_assert(static_cast<int>(MaterialType::DIFFUSE_AND_REFRACTION) + 1 == materialTypeCount, "update materialTypeCount along with MaterialType");
 
 public:
     MaterialType materialType;
@@ -33,13 +55,28 @@ public:
         float ior = 1.3
     );
 
-    float pdf(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo);
+    /**
+     * @brief Sample an outgoing direction, cosine-weighted for diffuse lobes and around the highlight
+     *        for the Phong lobe. The Fresnel term is computed once for the direction, its value and its pdf.
+     * @param wi The incident view direction
+     */
+    BSDFSample sample(const cv::Vec3f &normal, const cv::Vec3f &wi) const;
 
-    cv::Vec3f sampleDir(const cv::Vec3f &normal, const cv::Vec3f &wi) const;
+    // the BSDF for a given pair of directions, e.g. towards a light sample
+    cv::Vec3f eval(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo) const;
+
+    // the pdf with which sample would return wo
+    float pdf(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo) const;
 
     cv::Vec3f specularBRDF(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo) const;
 
     cv::Vec3f lambertianBRDF(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo) const;
+
+private:
+    // eval and pdf for a Fresnel reflectance fr computed by the caller, unused by the materials without it
+    cv::Vec3f eval(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo, float fr) const;
+    float pdf(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo, float fr) const;
+    float fresnel(const cv::Vec3f &normal, const cv::Vec3f &wi) const;
 };
 
 namespace zoe {
@@ -113,6 +113,96 @@ std::pair<Camera, std::map<const std::string, cv::Vec3f>> ModelLoader::loadXML(c
     return std::make_pair(camera, lights);
 }
 
+Material ModelLoader::loadMaterial(const tinyobj::material_t &mtl, const std::map<const std::string, cv::Vec3f> &lights, const std::string &colorFmt)
+{
+    Material material;
+
+    if (lights.count(mtl.name))
+    {
+        material.emission = lights.at(mtl.name);
+    }
+    else 
+    {   
+        if (colorFmt == "bgr")
+        {
+            material.emission = cv::Vec3f(
+                mtl.emission[2],
+                mtl.emission[1], 
+                mtl.emission[0]
+            );
+        }
+        else
+        {
+            material.emission = cv::Vec3f(
+                mtl.emission[0],
+                mtl.emission[1], 
+                mtl.emission[2]
+            );
+        }
+    }
+
+    if (colorFmt == "bgr")
+    {
+        material.kd = cv::Vec3f(
+            mtl.diffuse[2], 
+            mtl.diffuse[1], 
+            mtl.diffuse[0]
+        );
+        material.ks = cv::Vec3f(
+            mtl.specular[2], 
+            mtl.specular[1], 
+            mtl.specular[0]
+        );
+        material.tr = cv::Vec3f(
+            mtl.transmittance[2], 
+            mtl.transmittance[1], 
+            mtl.transmittance[0]
+        );
+    }
+    else 
+    {
+        material.kd = cv::Vec3f(
+            mtl.diffuse[0], 
+            mtl.diffuse[1], 
+            mtl.diffuse[2]
+        );
+        material.ks = cv::Vec3f(
+            mtl.specular[0], 
+            mtl.specular[1], 
+            mtl.specular[2]
+        );
+        material.tr = cv::Vec3f(
+            mtl.transmittance[0], 
+            mtl.transmittance[1], 
+            mtl.transmittance[2]
+        );
+    }
+    material.ior = mtl.ior;
+    material.specularExp = mtl.shininess;
+
+    if (material.kd != cv::Vec3f(0, 0, 0))
+    {
+        material.materialType = Material::MaterialType::DIFFUSE_AND_GLOSSY;
+        if (material.ks != cv::Vec3f(0, 0, 0))
+        {
+            material.materialType = Material::MaterialType::DIFFUSE_AND_REFLECTION;
+        }
+        if (material.tr != cv::Vec3f(1, 1, 1))
+        {
+            material.materialType = Material::MaterialType::DIFFUSE_AND_REFRACTION;
+        }
+    }
+    else
+    {
+        material.materialType = Material::MaterialType::REFLECTION;
+        if (material.tr != cv::Vec3f(1, 1, 1))
+        {
+            material.materialType = Material::MaterialType::REFLECTION_AND_REFRACTION;
+        }
+    }
+    return material;
+}
+
 std::pair<std::vector<Triangle>, Camera> ModelLoader::loadOBJ(const std::string &filename, const std::string &colorFmt)
 {
     const std::string folder = filename.substr(0, filename.find_last_of("/\\") + 1);
@@ -205,116 +295,118 @@ std::pair<std::vector<Triangle>, Camera> ModelLoader::loadOBJ(const std::string
             triangle.setTexCoords(vtexcoords);
             
             int materialId = shapes[s].mesh.material_ids[f];
-            const std::string materialName = materials[materialId].name;
-            Material material;
-
             if (materials[materialId].diffuse_texname != "")
             {
                 triangle.setTexturePath(materials[materialId].diffuse_texname);
                 std::string textureName = folder + materials[materialId].diffuse_texname;
                 triangle.setTexture(std::make_shared<const cv::Mat3f>(textures[textureName]));
             }
+            triangle.setMaterial(ModelLoader::loadMaterial(materials[materialId], lights, colorFmt));
 
-            if (lights.count(materialName))
-            {
-                material.emission = lights[materialName];
-            }
-            else 
-            {   
-                if (colorFmt == "bgr")
-                {
-                    material.emission = cv::Vec3f(
-                        materials[materialId].emission[2],
-                        materials[materialId].emission[1], 
-                        materials[materialId].emission[0]
-                    );
-                }
-                else
-                {
-                    material.emission = cv::Vec3f(
-                        materials[materialId].emission[0],
-                        materials[materialId].emission[1], 
-                        materials[materialId].emission[2]
-                    );
-                }
-            }
+            triangles.push_back(triangle);
+        }
+    }
+    std::cout << "Loaded " << triangles.size() << " triangles from " << filename << std::endl;
+    return std::make_pair(triangles, camera);
+}
 
-            if (colorFmt == "bgr")
-            {
-                material.kd = cv::Vec3f(
-                    materials[materialId].diffuse[2], 
-                    materials[materialId].diffuse[1], 
-                    materials[materialId].diffuse[0]
-                );
-                material.ks = cv::Vec3f(
-                    materials[materialId].specular[2], 
-                    materials[materialId].specular[1], 
-                    materials[materialId].specular[0]
-                );
-                material.tr = cv::Vec3f(
-                    materials[materialId].transmittance[2], 
-                    materials[materialId].transmittance[1], 
-                    materials[materialId].transmittance[0]
-                );
-            }
-            else 
-            {
-                material.kd = cv::Vec3f(
-                    materials[materialId].diffuse[0], 
-                    materials[materialId].diffuse[1], 
-                    materials[materialId].diffuse[2]
-                );
-                material.ks = cv::Vec3f(
-                    materials[materialId].specular[0], 
-                    materials[materialId].specular[1], 
-                    materials[materialId].specular[2]
-                );
-                material.tr = cv::Vec3f(
-                    materials[materialId].transmittance[0], 
-                    materials[materialId].transmittance[1], 
-                    materials[materialId].transmittance[2]
-                );
-            }
-            material.ior = materials[materialId].ior;
-            material.specularExp = materials[materialId].shininess;
+std::pair<std::shared_ptr<TriangleMesh>, Camera> ModelLoader::loadMesh(const std::string &filename, const std::string &colorFmt)
+{
+    const std::string folder = filename.substr(0, filename.find_last_of("/\\") + 1);
+    const std::string file = filename.substr(filename.find_last_of("/\\") + 1);
+    const std::string modelName = file.substr(0, file.find_last_of("."));
+    const std::string xmlName = folder + modelName + ".xml";
+
+    auto [camera, lights] = ModelLoader::loadXML(xmlName);
+    std::map<std::string, cv::Mat3f> textures = ModelLoader::loadTexture(folder + "textures");
+
+    tinyobj::ObjReaderConfig readerConfig;
+    readerConfig.mtl_search_path = "";
+    tinyobj::ObjReader reader;
+
+    if (!reader.ParseFromFile(filename, readerConfig))
+    {
+        if (!reader.Error().empty())
+        {
+            std::cerr << "TinyObjReader: " << reader.Error();
+        }
+        exit(1);
+    }
 
-            if (material.kd != cv::Vec3f(0, 0, 0))
+    if (!reader.Warning().empty())
+    {
+        std::cout << "TinyObjReader: " << reader.Warning();
+    }
+
+    auto &attrib = reader.GetAttrib();
+    auto &shapes = reader.GetShapes();
+    auto &materials = reader.GetMaterials();
+
+    auto mesh = std::make_shared<TriangleMesh>();
+    // one surface per material, its texture is loaded once
+    std::map<int, int> surfaces;
+    // a vertex is shared by all faces that use the same position and texture coordinate
+    std::map<std::pair<int, int>, int> vertices;
+
+    for (size_t s = 0; s < shapes.size(); s++)
+    {
+        size_t index_offset = 0;
+        for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++)
+        {
+            size_t fv = static_cast<size_t>(shapes[s].mesh.num_face_vertices[f]);
+
+            std::array<int, 3> face;
+            for (size_t v = 0; v < fv; v++)
             {
-                material.materialType = Material::MaterialType::DIFFUSE_AND_GLOSSY;
-                if (material.ks != cv::Vec3f(0, 0, 0))
-                {
-                    material.materialType = Material::MaterialType::DIFFUSE_AND_REFLECTION;
-                }
-                if (material.tr != cv::Vec3f(1, 1, 1))
+                tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
+                auto key = std::make_pair(idx.vertex_index, idx.texcoord_index);
+                auto it = vertices.find(key);
+                if (it == vertices.end())
                 {
-                    material.materialType = Material::MaterialType::DIFFUSE_AND_REFRACTION;
+                    cv::Vec3f position(
+                        attrib.vertices[3 * size_t(idx.vertex_index) + 0],
+                        attrib.vertices[3 * size_t(idx.vertex_index) + 1],
+                        attrib.vertices[3 * size_t(idx.vertex_index) + 2]
+                    );
+                    cv::Vec2f texCoord(0, 0);
+                    if (idx.texcoord_index >= 0)
+                    {
+                        texCoord = cv::Vec2f(
+                            attrib.texcoords[2 * size_t(idx.texcoord_index) + 0],
+                            attrib.texcoords[2 * size_t(idx.texcoord_index) + 1]
+                        );
+                    }
+                    it = vertices.emplace(key, mesh->addVertex(position, texCoord)).first;
                 }
+                face[v] = it->second;
             }
-            else
+            index_offset += fv;
+
+            int materialId = shapes[s].mesh.material_ids[f];
+            if (!surfaces.count(materialId))
             {
-                material.materialType = Material::MaterialType::REFLECTION;
-                if (material.tr != cv::Vec3f(1, 1, 1))
+                auto surface = std::make_shared<MeshSurface>(ModelLoader::loadMaterial(materials[materialId], lights, colorFmt));
+                if (materials[materialId].diffuse_texname != "")
                 {
-                    material.materialType = Material::MaterialType::REFLECTION_AND_REFRACTION;
+                    surface->setTexturePath(materials[materialId].diffuse_texname);
+                    std::string textureName = folder + materials[materialId].diffuse_texname;
+                    surface->setTexture(std::make_shared<const cv::Mat3f>(textures[textureName]));
                 }
+                surfaces[materialId] = mesh->addSurface(surface);
             }
-
-            triangle.setMaterial(material);
-
-            triangles.push_back(triangle);
+            mesh->addFace(face[0], face[1], face[2], surfaces[materialId]);
         }
     }
-    std::cout << "Loaded " << triangles.size() << " triangles from " << filename << std::endl;
-    return std::make_pair(triangles, camera);
+    std::cout << "Loaded " << mesh->getFaceCount() << " faces, " << mesh->getVertexCount() << " vertices from " << filename << std::endl;
+    return std::make_pair(mesh, camera);
 }
 
 BVHScene ModelLoader::loadBVHScene(const std::string &filename)
 {
-    auto [triangles, camera] = ModelLoader::loadOBJ(filename);
+    auto [mesh, camera] = ModelLoader::loadMesh(filename);
     BVHScene scene(camera, cv::Vec3f());
-    for (const auto &triangle : triangles)
-    {
-        scene.add(std::make_shared<Triangle>(triangle));
-    }
+    scene.add(mesh);
+    // the cache lives next to the model and is invalidated by its content hash
+    scene.setBVHCachePath(filename.substr(0, filename.find_last_of(".")) + ".bvh");
     return scene;
 }
\ No newline at end of file
@@ -9,10 +9,14 @@
 #include <tinyobjloader/tiny_obj_loader.h>
 #include "common/Camera.h"
 #include "objects/Triangle.h"
+#include "objects/TriangleMesh.h"
 #include "Scene.h"
 
 class ModelLoader
 {
+private:
+    static Material loadMaterial(const tinyobj::material_t &mtl, const std::map<const std::string, cv::Vec3f> &lights, const std::string &colorFmt);
+
 public:
     static std::pair<Camera, std::map<const std::string, cv::Vec3f>> loadXML(const std::string &filepath, const std::string &colorFmt = "bgr");
 
@@ -20,6 +24,11 @@ public:
 
     static std::pair<std::vector<Triangle>, Camera> loadOBJ(const std::string &filename, const std::string &colorFmt = "bgr");
 
+    /**
+     * @brief Load the model as one indexed mesh, the faces share their vertices and materials
+     */
+    static std::pair<std::shared_ptr<TriangleMesh>, Camera> loadMesh(const std::string &filename, const std::string &colorFmt = "bgr");
+
     static BVHScene loadBVHScene(const std::string &filename);
 
 };
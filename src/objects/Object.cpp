@@ -25,76 +25,58 @@ Object::Object(cv::Vec3f diffuseColor, Material::MaterialType materialType, floa
     m_material.materialType = materialType;
 }
 
-cv::Vec3f Object::evalLightBRDF(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo) const
+bool Object::hitPrimitive(const Ray &ray, int prim, PrimitiveHit &hit) const
 {
-    switch (m_material.materialType)
+    std::optional<HitPayload> payload = intersectPrimitive(ray, prim);
+    if (!payload.has_value())
     {
-        case Material::MaterialType::DIFFUSE_AND_GLOSSY:
-        {
-            float cosTheta = std::clamp(normal.dot(wo), 0.0f, 1.0f);
-            if (cosTheta > 0)
-            {
-                return m_material.kd / M_PI;
-            }
-            return cv::Vec3f(0, 0, 0);
-        }
-        case Material::MaterialType::REFLECTION:
-        {
-            float cosTheta = normal.dot(wo);
-            if (normal.dot(wo) > 0)
-            {
-                float kr = zoe::fresnel(wi, normal, getIor());
-                if (cosTheta < 0.001)
-                {
-                    return cv::Vec3f(0, 0, 0);
-                }
-                return cv::Vec3f(kr / cosTheta, kr / cosTheta, kr / cosTheta);
-            }
-            return cv::Vec3f(0, 0, 0);
-        }
-        case Material::MaterialType::REFLECTION_AND_REFRACTION:
-        {
-            float cosTheta = normal.dot(wo);
-            if (cosTheta > 0)
-            {
-                float kr = zoe::fresnel(wi, normal, getIor());
-                return cv::Vec3f(kr / cosTheta, kr / cosTheta, kr / cosTheta);
-            }
-            else if (cosTheta < 0)
-            {
-                float kt = 1 - zoe::fresnel(wi, normal, getIor());
-                cv::Vec3f res(kt / -cosTheta, kt / -cosTheta, kt / -cosTheta);
-                if (m_material.tr != cv::Vec3f(0, 0, 0))
-                {
-                    return res.mul(m_material.tr);
-                }
-                return res;
-            }
-            return cv::Vec3f(0, 0, 0);
-        }
-        case Material::MaterialType::DIFFUSE_AND_REFLECTION:
-        {
-            return m_material.specularBRDF(normal, wi, wo);
-        }
-        case Material::MaterialType::DIFFUSE_AND_REFRACTION:
+        return false;
+    }
+    hit.t = payload->dist;
+    hit.u = payload->uv[0];
+    hit.v = payload->uv[1];
+    hit.emissive = payload->emissive();
+    return true;
+}
+
+HitPayload Object::makePrimitiveHit(const Ray &ray, int prim, const PrimitiveHit &hit) const
+{
+    // the test is repeated with the ray that found the hit, so it finds the same one
+    std::optional<HitPayload> payload = intersectPrimitive(ray, prim);
+    if (!payload.has_value())
+    {
+        throw std::runtime_error("Object::makePrimitiveHit: the ray does not hit the primitive");
+    }
+    return payload.value();
+}
+
+int Object::intersectPacket(const RayPacket &packet, int prim, int activeMask, PrimitiveHit *hits) const
+{
+    int mask = 0;
+    for (int i = 0; i < packet.size; i++)
+    {
+        if ((activeMask >> i & 1) && hitPrimitive(packet.getRay(i), prim, hits[i]))
         {
-            float cosTheta = normal.dot(wo);
-            if (cosTheta > 0)
-            {
-                return m_material.kd / M_PI;
-            }
-            else if (cosTheta < 0)
-            {
-                float kt = 1 - zoe::fresnel(wi, normal, getIor());
-                cv::Vec3f res(kt / -cosTheta, kt / -cosTheta, kt / -cosTheta);
-                if (m_material.tr != cv::Vec3f(0, 0, 0))
-                {
-                    return res.mul(m_material.tr);
-                }
-                return res;
-            }
-            return cv::Vec3f(0, 0, 0);
+            mask |= 1 << i;
         }
     }
-    throw std::runtime_error("Unsupported material type.");
+    return mask;
+}
+
+void Object::splitAABB(int axis, float plane, const AABB &bound, AABB &left, AABB &right) const
+{
+    // conservative: only the box is clipped, not the shape
+    cv::Vec3f leftMax = bound.getMax();
+    cv::Vec3f rightMin = bound.getMin();
+    leftMax[axis] = std::min(leftMax[axis], plane);
+    rightMin[axis] = std::max(rightMin[axis], plane);
+    left = AABB(bound.getMin(), leftMax);
+    right = AABB(rightMin, bound.getMax());
+}
+
+uint64_t Object::getGeometryHash() const
+{
+    AABB aabb = getAABB();
+    return zoe::hashValue(aabb.getMax(), zoe::hashValue(aabb.getMin()));
 }
+
@@ -1,13 +1,15 @@
 #ifndef __OBJECTS_OBJECT_H__
 #define __OBJECTS_OBJECT_H__
 
+#include <memory>
 #include <opencv2/opencv.hpp>
 #include "common/AABB.h"
 #include "common/Ray.h"
+#include "common/RayPacket.h"
 #include "objects/Material.h"
 #include "objects/HitPayload.h"
 
-class Object : public std::enable_shared_from_this<const Object>
+class Object
 {
 private:
     cv::Vec3f m_diffuseColor;   // color of diffuse light
@@ -21,15 +23,28 @@ public:
     Object(cv::Vec3f diffuseColor, Material::MaterialType materialType, float kd = 0.8, float ks = 0.2, float specularExp = 25.0, float ior = 1.3);
     virtual ~Object() = default;
 
-    virtual cv::Vec3f evalLightBRDF(const cv::Vec3f &normal, const cv::Vec3f &wi, const cv::Vec3f &wo) const;
-
     /**
      * @brief Intersect a ray with the object
      * @param orig The origin of the ray
      * @param dir The direction of the ray
      */
     virtual std::optional<HitPayload> intersect(const Ray &ray) const = 0;
+
+
+    /**
+     * @brief Any-hit test for shadow rays, no payload is built
+     * @param ray The ray, hits beyond its tMax are ignored
+     */
+    virtual bool occluded(const Ray &ray) const { return intersect(ray).has_value(); }
     virtual AABB getAABB() const = 0;
+
+    /**
+     * @brief Split the part of the object inside bound by an axis-aligned plane, used by spatial BVH splits
+     * @param left The bounds of the part below the plane, clipped to bound
+     * @param right The bounds of the part above the plane, clipped to bound
+     */
+    virtual void splitAABB(int axis, float plane, const AABB &bound, AABB &left, AABB &right) const;
+
     virtual cv::Vec3f getNormal(const cv::Vec3f &point) const = 0;
     virtual float getArea() const = 0;
     virtual HitPayload samplePoint() const = 0;
@@ -42,7 +57,7 @@ public:
     virtual cv::Vec3f getKd() const { return m_material.kd; }
     virtual cv::Vec3f getKs() const { return m_material.ks; }
     virtual cv::Vec3f getEmission() const { return m_material.emission; }
-    virtual Material getMaterial() const { return m_material; }
+    virtual const Material &getMaterial() const { return m_material; }
     virtual std::string getTexturePath() const { return m_texturePath; }
     virtual std::shared_ptr<const cv::Mat3f> getTexture() const { return m_texture; }
 
@@ -58,6 +73,44 @@ public:
     virtual void setTexture(std::shared_ptr<const cv::Mat3f> texture) { m_texture = texture; }
 
     virtual bool emissive() const { return m_material.emission != cv::Vec3f(0, 0, 0); }
+
+    /**
+     * @brief Hash of the shape, used to detect geometry changes between runs
+     */
+    virtual uint64_t getGeometryHash() const;
+
+    /**
+     * @brief Number of primitives the BVH builds over, e.g. the faces of a mesh.
+     *        A single-primitive object answers the primitive queries below with its own shape.
+     */
+    virtual int getPrimitiveCount() const { return 1; }
+    virtual AABB getPrimitiveAABB(int prim) const { return getAABB(); }
+    virtual void splitPrimitiveAABB(int prim, int axis, float plane, const AABB &bound, AABB &left, AABB &right) const { splitAABB(axis, plane, bound, left, right); }
+    virtual std::optional<HitPayload> intersectPrimitive(const Ray &ray, int prim) const { return intersect(ray); }
+    virtual bool occludedPrimitive(const Ray &ray, int prim) const { return occluded(ray); }
+
+    /**
+     * @brief Hit test of one primitive that only reports distance and barycentric coordinates,
+     *        the BVH builds the payload with makePrimitiveHit once, for the closest hit.
+     *        The defaults go through intersectPrimitive.
+     */
+    virtual bool hitPrimitive(const Ray &ray, int prim, PrimitiveHit &hit) const;
+    // ray must be the ray that hitPrimitive accepted the hit with
+    virtual HitPayload makePrimitiveHit(const Ray &ray, int prim, const PrimitiveHit &hit) const;
+
+    /**
+     * @brief hitPrimitive for the active lanes of a ray packet, the default tests one lane after another
+     * @param hits Lane i receives the hit of ray i, hits beyond its tMax are ignored
+     * @return The mask of lanes that hit the primitive
+     */
+    virtual int intersectPacket(const RayPacket &packet, int prim, int activeMask, PrimitiveHit *hits) const;
+
+    /**
+     * @brief The vertices of a primitive that is a plain triangle, which lets the BVH pack it into a TriangleBlock
+     * @return false if the primitive is not a triangle
+     */
+    virtual bool getPrimitiveTriangle(int prim, std::array<cv::Vec3f, 3> &vertices) const { return false; }
+    virtual bool isPrimitiveEmissive(int prim) const { return emissive(); }
 };
 
 #endif
\ No newline at end of file
@@ -8,6 +8,16 @@ Sphere::Sphere(const cv::Vec3f &center, float radius)
 }
 
 std::optional<HitPayload> Sphere::intersect(const Ray &ray) const
+{
+    PrimitiveHit hit;
+    if (!hitPrimitive(ray, 0, hit))
+    {
+        return std::nullopt;
+    }
+    return makePrimitiveHit(ray, 0, hit);
+}
+
+bool Sphere::hitPrimitive(const Ray &ray, int prim, PrimitiveHit &hit) const
 {
     const cv::Vec3f &orig = ray.getOrig();
     const cv::Vec3f &dir = ray.getDir();
@@ -17,18 +27,52 @@ std::optional<HitPayload> Sphere::intersect(const Ray &ray) const
     auto x = zoe::solveQuad(a, b, c);
     if (!x.has_value())
     {
-        return std::nullopt;
+        return false;
     }
     auto [x1, x2] = x.value();
+    float t = x1;
     if (x1 < 0)
     {
-        if (x2 < 0)
+        if (x2 < 0 || x2 > ray.getTMax())
         {
-            return std::nullopt;
+            return false;
         }
-        return HitPayload(cv::Vec2f(0.0, 0.0), shared_from_this(), x2, getEmission());
+        t = x2;
+    }
+    else if (x1 > ray.getTMax())
+    {
+        return false;
+    }
+    hit.t = t;
+    hit.u = 0;
+    hit.v = 0;
+    hit.emissive = emissive();
+    return true;
+}
+
+HitPayload Sphere::makePrimitiveHit(const Ray &ray, int prim, const PrimitiveHit &hit) const
+{
+    HitPayload res(cv::Vec2f(0.0, 0.0), this, hit.t, getEmission());
+    res.point = ray.getOrig() + hit.t * ray.getDir();
+    res.normal = getNormal(res.point);
+    return res;
+}
+
+bool Sphere::occluded(const Ray &ray) const
+{
+    const cv::Vec3f &orig = ray.getOrig();
+    const cv::Vec3f &dir = ray.getDir();
+    float a = dir.dot(dir);
+    float b = 2 * dir.dot(orig - m_center);
+    float c = (orig - m_center).dot(orig - m_center) - m_radius * m_radius;
+    auto x = zoe::solveQuad(a, b, c);
+    if (!x.has_value())
+    {
+        return false;
     }
-    return HitPayload(cv::Vec2f(0.0, 0.0), shared_from_this(), x1, getEmission());
+    auto [x1, x2] = x.value();
+    auto blocks = [&ray](float t) { return t > zoe::selfCrossEpsilon && t <= ray.getTMax(); };
+    return blocks(x1) || blocks(x2);
 }
 
 AABB Sphere::getAABB() const
@@ -49,6 +93,11 @@ float Sphere::getArea() const
     return 4 * M_PI * m_radius * m_radius;
 }
 
+uint64_t Sphere::getGeometryHash() const
+{
+    return zoe::hashValue(m_radius, zoe::hashValue(m_center));
+}
+
 HitPayload Sphere::samplePoint() const
 {
     return HitPayload();
@@ -13,12 +13,16 @@ public:
     Sphere(const cv::Vec3f &center, float radius);
 
     virtual std::optional<HitPayload> intersect(const Ray &ray) const override;
+    virtual bool hitPrimitive(const Ray &ray, int prim, PrimitiveHit &hit) const override;
+    virtual HitPayload makePrimitiveHit(const Ray &ray, int prim, const PrimitiveHit &hit) const override;
+    virtual bool occluded(const Ray &ray) const override;
 
     virtual AABB getAABB() const override;
 
     virtual cv::Vec3f getNormal(const cv::Vec3f &point) const override;
     virtual float getArea() const override;
     virtual HitPayload samplePoint() const override;
+    virtual uint64_t getGeometryHash() const override;
     virtual cv::Vec2f getTexCoords(const cv::Vec2f &uv) const override { return cv::Vec2f(0, 0); }
 };
 
@@ -3,45 +3,237 @@
 #include "common/OBJ_Loader.h"
 #include "common/utils.h"
 #include "Triangle.h"
+#if ZOE_X86
+#include <immintrin.h>
+#endif
+
+#if WATERTIGHT_TRIANGLE_TEST
+namespace {
+
+// Woop, Benthin and Wald, Watertight Ray/Triangle Intersection, JCGT 2013
+bool hitTestWatertight(const std::array<cv::Vec3f, 3> &vertices, const Ray &ray, float &t, float &u, float &v)
+{
+    const cv::Vec3f &orig = ray.getOrig();
+    const cv::Vec3f &dir = ray.getDir();
+    // the dominant axis of the direction becomes z, swapping x and y keeps the winding
+    int kz = 0;
+    for (int a = 1; a < 3; a++)
+    {
+        if (std::abs(dir[a]) > std::abs(dir[kz]))
+        {
+            kz = a;
+        }
+    }
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (dir[kz] < 0)
+    {
+        std::swap(kx, ky);
+    }
+    float sx = dir[kx] / dir[kz];
+    float sy = dir[ky] / dir[kz];
+    float sz = 1.0f / dir[kz];
+
+    // the vertices in a space where the ray starts at the origin and runs along +z
+    float x[3], y[3], z[3];
+    for (int i = 0; i < 3; i++)
+    {
+        cv::Vec3f p = vertices[i] - orig;
+        x[i] = p[kx] - sx * p[kz];
+        y[i] = p[ky] - sy * p[kz];
+        z[i] = sz * p[kz];
+    }
+
+    // scaled barycentric coordinates of v0, v1 and v2
+    float b0 = x[2] * y[1] - y[2] * x[1];
+    float b1 = x[0] * y[2] - y[0] * x[2];
+    float b2 = x[1] * y[0] - y[1] * x[0];
+    if (b0 == 0 || b1 == 0 || b2 == 0)
+    {
+        // the ray runs through an edge, decide it in double so that both triangles of the edge agree
+        b0 = static_cast<double>(x[2]) * y[1] - static_cast<double>(y[2]) * x[1];
+        b1 = static_cast<double>(x[0]) * y[2] - static_cast<double>(y[0]) * x[2];
+        b2 = static_cast<double>(x[1]) * y[0] - static_cast<double>(y[1]) * x[0];
+    }
+    if ((b0 < 0 || b1 < 0 || b2 < 0) && (b0 > 0 || b1 > 0 || b2 > 0))
+    {
+        return false;
+    }
+    float det = b0 + b1 + b2;
+    if (det == 0)
+    {
+        return false;
+    }
+    float invDet = 1.0f / det;
+    t = (b0 * z[0] + b1 * z[1] + b2 * z[2]) * invDet;
+    u = b1 * invDet;
+    v = b2 * invDet;
+    return t >= zoe::selfCrossEpsilon && t <= ray.getTMax();
+}
+
+}
+#endif
 
 Triangle::Triangle()
 {
     m_vertices = std::array<cv::Vec3f, 3>();
+    m_hitTestData = precompute(m_vertices);
 }
 
 Triangle::Triangle(const std::array<cv::Vec3f, 3> &vertices) :
     m_vertices(vertices)
 {
-    cv::Vec3f edge1 = m_vertices[1] - m_vertices[0];
-    cv::Vec3f edge2 = m_vertices[2] - m_vertices[0];
-    m_normal = cv::normalize(edge1.cross(edge2));
+    m_hitTestData = precompute(m_vertices);
+    m_normal = cv::normalize(m_hitTestData.normal);
 }
 
-std::optional<HitPayload> Triangle::intersect(const Ray &ray) const
+void Triangle::setVertex(int index, const cv::Vec3f &vertex)
 {
-    const cv::Vec3f &orig = ray.getOrig();
-    const cv::Vec3f &dir = ray.getDir();
-    cv::Vec3f edge1 = m_vertices[1] - m_vertices[0];
-    cv::Vec3f edge2 = m_vertices[2] - m_vertices[0];
-    cv::Vec3f s = orig - m_vertices[0];
-    cv::Vec3f s1 = dir.cross(edge2);
-    cv::Vec3f s2 = s.cross(edge1);
+    m_vertices[index] = vertex;
+    // keep the face normal in sync, getNormal recomputes it while the triangle is degenerate
+    m_hitTestData = precompute(m_vertices);
+    float length = cv::norm(m_hitTestData.normal);
+    m_normal = length > 0 ? cv::Vec3f(m_hitTestData.normal / length) : cv::Vec3f(0, 0, 0);
+}
 
-    float tmp = 1.0 / (s1.dot(edge1) == 0 ? zoe::denominatorEpsilon : s1.dot(edge1));
-    float t = tmp * s2.dot(edge2);
-    float u = tmp * s1.dot(s);
-    float v = tmp * s2.dot(dir);
+Triangle::HitTestData Triangle::precompute(const std::array<cv::Vec3f, 3> &vertices)
+{
+    HitTestData data;
+    data.edge1 = vertices[1] - vertices[0];
+    data.edge2 = vertices[2] - vertices[0];
+    data.normal = data.edge1.cross(data.edge2);
+    return data;
+}
 
-    if (t < zoe::selfCrossEpsilon || u < 0 || v < 0 || u + v > 1)
+bool Triangle::hitTest(const std::array<cv::Vec3f, 3> &vertices, const HitTestData &data, const Ray &ray, float &t, float &u, float &v)
+{
+#if WATERTIGHT_TRIANGLE_TEST
+    return hitTestWatertight(vertices, ray, t, u, v);
+#else
+    // Moller-Trumbore with the triple products rewritten around the precomputed normal,
+    // one cross product per ray instead of two. Most tests miss, so the result is combined
+    // without branches; a zero determinant gives inf or nan and is rejected with the rest.
+    const cv::Vec3f &dir = ray.getDir();
+    float det = -dir.dot(data.normal);
+    float invDet = 1.0f / det;
+    cv::Vec3f s = ray.getOrig() - vertices[0];
+    cv::Vec3f q = s.cross(dir);
+    t = s.dot(data.normal) * invDet;
+    u = data.edge2.dot(q) * invDet;
+    v = -data.edge1.dot(q) * invDet;
+    return (det != 0) & (t >= zoe::selfCrossEpsilon) & (t <= ray.getTMax()) & (u >= 0) & (v >= 0) & (u + v <= 1);
+#endif
+}
+
+std::optional<HitPayload> Triangle::intersect(const Ray &ray) const
+{
+    PrimitiveHit hit;
+    if (!hitPrimitive(ray, 0, hit))
     {
         return std::nullopt;
     }
+    return makePrimitiveHit(ray, 0, hit);
+}
+
+bool Triangle::hitPrimitive(const Ray &ray, int prim, PrimitiveHit &hit) const
+{
+    if (!hitTest(m_vertices, m_hitTestData, ray, hit.t, hit.u, hit.v))
+    {
+        return false;
+    }
+    hit.emissive = emissive();
+    return true;
+}
 
-    HitPayload res(cv::Vec2f(u, v), shared_from_this(), t, getEmission());
-    res.point = orig + t * dir;
+HitPayload Triangle::makePrimitiveHit(const Ray &ray, int prim, const PrimitiveHit &hit) const
+{
+    HitPayload res(cv::Vec2f(hit.u, hit.v), this, hit.t, getEmission());
+    res.point = ray.getOrig() + hit.t * ray.getDir();
+    res.normal = getNormal(res.point);
+    res.st = getTexCoords(res.uv);
     return res;
 }
 
+int Triangle::hitTest(const std::array<cv::Vec3f, 3> &vertices, const HitTestData &data, const RayPacket &packet, int activeMask, float *tHit, float *uHit, float *vHit)
+{
+    int mask = 0;
+#if ZOE_X86 && !WATERTIGHT_TRIANGLE_TEST
+    // the same arithmetic as the single-ray test, one ray per lane, so both agree bit for bit
+    __m128 e1[3], e2[3], n[3], v0[3];
+    for (int a = 0; a < 3; a++)
+    {
+        e1[a] = _mm_set1_ps(data.edge1[a]);
+        e2[a] = _mm_set1_ps(data.edge2[a]);
+        n[a] = _mm_set1_ps(data.normal[a]);
+        v0[a] = _mm_set1_ps(vertices[0][a]);
+    }
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 signBit = _mm_set1_ps(-0.0f);
+    for (int base = 0; base < packet.size; base += 4)
+    {
+        __m128 d[3], s[3];
+        for (int a = 0; a < 3; a++)
+        {
+            d[a] = _mm_load_ps(packet.dir[a] + base);
+            s[a] = _mm_sub_ps(_mm_load_ps(packet.orig[a] + base), v0[a]);
+        }
+        __m128 det = _mm_xor_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], n[0]), _mm_mul_ps(d[1], n[1])), _mm_mul_ps(d[2], n[2])), signBit);
+        __m128 invDet = _mm_div_ps(one, det);
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(s[1], d[2]), _mm_mul_ps(s[2], d[1]));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(s[2], d[0]), _mm_mul_ps(s[0], d[2]));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(s[0], d[1]), _mm_mul_ps(s[1], d[0]));
+
+        __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(s[0], n[0]), _mm_mul_ps(s[1], n[1])), _mm_mul_ps(s[2], n[2])), invDet);
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2[0], qx), _mm_mul_ps(e2[1], qy)), _mm_mul_ps(e2[2], qz)), invDet);
+        __m128 v = _mm_mul_ps(_mm_xor_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], qx), _mm_mul_ps(e1[1], qy)), _mm_mul_ps(e1[2], qz)), signBit), invDet);
+        __m128 hit = _mm_andnot_ps(_mm_cmpeq_ps(det, zero), _mm_cmpge_ps(t, _mm_set1_ps(zoe::selfCrossEpsilon)));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(t, _mm_load_ps(packet.tMax + base)));
+        hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), one));
+        _mm_storeu_ps(tHit + base, t);
+        _mm_storeu_ps(uHit + base, u);
+        _mm_storeu_ps(vHit + base, v);
+        mask |= _mm_movemask_ps(hit) << base;
+    }
+#else
+    for (int i = 0; i < packet.size; i++)
+    {
+        if (activeMask >> i & 1)
+        {
+            mask |= hitTest(vertices, data, packet.getRay(i), tHit[i], uHit[i], vHit[i]) << i;
+        }
+    }
+#endif
+    return mask & activeMask;
+}
+
+int Triangle::intersectPacket(const RayPacket &packet, int prim, int activeMask, PrimitiveHit *hits) const
+{
+    float tHit[RayPacket::maxSize];
+    float uHit[RayPacket::maxSize];
+    float vHit[RayPacket::maxSize];
+    int mask = hitTest(m_vertices, m_hitTestData, packet, activeMask, tHit, uHit, vHit);
+    bool isEmissive = emissive();
+    for (int i = 0; i < packet.size; i++)
+    {
+        if (mask >> i & 1)
+        {
+            hits[i].t = tHit[i];
+            hits[i].u = uHit[i];
+            hits[i].v = vHit[i];
+            hits[i].emissive = isEmissive;
+        }
+    }
+    return mask;
+}
+
+bool Triangle::occluded(const Ray &ray) const
+{
+    float t, u, v;
+    return hitTest(m_vertices, m_hitTestData, ray, t, u, v);
+}
+
 AABB Triangle::getAABB() const
 {
     cv::Vec3f min = m_vertices[0];
@@ -57,20 +249,52 @@ AABB Triangle::getAABB() const
     return AABB(min, max);
 }
 
+void Triangle::splitAABB(int axis, float plane, const AABB &bound, AABB &left, AABB &right) const
+{
+    clipAABB(m_vertices, axis, plane, bound, left, right);
+}
+
+void Triangle::clipAABB(const std::array<cv::Vec3f, 3> &vertices, int axis, float plane, const AABB &bound, AABB &left, AABB &right)
+{
+    left = AABB();
+    right = AABB();
+    for (int i = 0; i < 3; i++)
+    {
+        const cv::Vec3f &v0 = vertices[i];
+        const cv::Vec3f &v1 = vertices[(i + 1) % 3];
+        float p0 = v0[axis];
+        float p1 = v1[axis];
+        if (p0 <= plane)
+        {
+            left = left + v0;
+        }
+        if (p0 >= plane)
+        {
+            right = right + v0;
+        }
+        // the edge crosses the plane
+        if ((p0 < plane && p1 > plane) || (p0 > plane && p1 < plane))
+        {
+            cv::Vec3f cross = v0 + (v1 - v0) * ((plane - p0) / (p1 - p0));
+            cross[axis] = plane;
+            left = left + cross;
+            right = right + cross;
+        }
+    }
+    left = left.intersection(bound);
+    right = right.intersection(bound);
+}
+
 cv::Vec3f Triangle::getNormal(const cv::Vec3f &point) const
 {
     if (m_normal != cv::Vec3f(0, 0, 0))
     {
         return m_normal;
     }
-    cv::Vec3f v0 = m_vertices[1] - m_vertices[0];
-    cv::Vec3f v1 = m_vertices[2] - m_vertices[0];
-    cv::Vec3f normal = v0.cross(v1);
-    normal = normal / cv::norm(normal);
-    return normal;
+    return m_hitTestData.normal / cv::norm(m_hitTestData.normal);
 }
 
-cv::Vec3f Triangle::getDiffuseColor(const cv::Vec2f &uv) const
+cv::Vec3f Triangle::getDiffuseColor(const cv::Vec2f &st) const
 {
     // cv::Vec3f color = Object::getDiffuseColor(uv);
     // if (color != cv::Vec3f(0, 0, 0))
@@ -86,7 +310,6 @@ cv::Vec3f Triangle::getDiffuseColor(const cv::Vec2f &uv) const
 
     if (getTexture() != nullptr)
     {
-        cv::Vec2f st = getTexCoords(uv);
         int i = static_cast<int>(st[0] * getTexture()->rows);
         int j = static_cast<int>(st[1] * getTexture()->cols);
         return getTexture()->at<cv::Vec3f>(i, j) / 255;
@@ -97,7 +320,7 @@ cv::Vec3f Triangle::getDiffuseColor(const cv::Vec2f &uv) const
 
 float Triangle::getArea() const
 {
-    return 0.5 * cv::norm((m_vertices[1] - m_vertices[0]).cross(m_vertices[2] - m_vertices[0]));
+    return 0.5 * cv::norm(m_hitTestData.normal);
 }
 
 HitPayload Triangle::samplePoint() const
@@ -110,11 +333,17 @@ HitPayload Triangle::samplePoint() const
 
     HitPayload payload;
     payload.point = point;
-    payload.hitObj = shared_from_this();
+    payload.normal = getNormal(point);
+    payload.hitObj = this;
     payload.emission = getEmission();
     return payload;
 }
 
+uint64_t Triangle::getGeometryHash() const
+{
+    return zoe::hashBytes(m_vertices.data(), sizeof(m_vertices));
+}
+
 cv::Vec2f Triangle::getTexCoords(const cv::Vec2f &uv) const
 {
     const cv::Vec2f &st0 = m_texCoords[0];
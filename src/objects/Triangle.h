@@ -5,8 +5,18 @@
 
 class Triangle : public Object
 {
+public:
+    // per-triangle part of the intersection test, computed once instead of for every ray
+    struct HitTestData
+    {
+        cv::Vec3f edge1;    // v1 - v0
+        cv::Vec3f edge2;    // v2 - v0
+        cv::Vec3f normal;   // edge1 x edge2, not normalized
+    };
+
 private:
     std::array<cv::Vec3f, 3> m_vertices;
+    HitTestData m_hitTestData;
     // the vertex normal of the triangle
     std::array<cv::Vec3f, 3> m_vNormal;
     // the texture coordinates of the triangle
@@ -21,17 +31,26 @@ public:
     Triangle(const std::array<cv::Vec3f, 3> &vertices);
 
     virtual std::optional<HitPayload> intersect(const Ray &ray) const override;
+    virtual bool hitPrimitive(const Ray &ray, int prim, PrimitiveHit &hit) const override;
+    virtual HitPayload makePrimitiveHit(const Ray &ray, int prim, const PrimitiveHit &hit) const override;
+    virtual int intersectPacket(const RayPacket &packet, int prim, int activeMask, PrimitiveHit *hits) const override;
+    virtual bool getPrimitiveTriangle(int prim, std::array<cv::Vec3f, 3> &vertices) const override { vertices = m_vertices; return true; }
+    virtual bool occluded(const Ray &ray) const override;
 
     virtual AABB getAABB() const override;
+    virtual void splitAABB(int axis, float plane, const AABB &bound, AABB &left, AABB &right) const override;
     virtual cv::Vec3f getNormal(const cv::Vec3f &point) const override;
-    virtual cv::Vec3f getDiffuseColor(const cv::Vec2f &uv) const override;
+    virtual cv::Vec3f getDiffuseColor(const cv::Vec2f &st) const override;
     virtual float getArea() const override;
     virtual HitPayload samplePoint() const override;
+    virtual uint64_t getGeometryHash() const override;
 
     virtual cv::Vec2f getTexCoords(const cv::Vec2f &uv) const override;
 
+    const cv::Vec3f &getVertex(int index) const { return m_vertices[index]; }
+
     // set i-th vertex coordinate
-    void setVertex(int index, const cv::Vec3f &vertex) { m_vertices[index] = vertex; }
+    void setVertex(int index, const cv::Vec3f &vertex);
     // set i-th vertex normal vector
     void setNormal(int index, const cv::Vec3f &normal) { m_vNormal[index] = normal; }
     // set i-th vertex texture coordinate
@@ -40,6 +59,20 @@ public:
     void setTexCoords(const std::array<cv::Vec2f, 3> &texCoords) { m_texCoords = texCoords; }
     void setColors(const std::array<cv::Vec3f, 3> &colors) { m_vColor = colors; }
 
+    static HitTestData precompute(const std::array<cv::Vec3f, 3> &vertices);
+
+    /**
+     * @brief Ray/triangle test, shared with TriangleMesh. Rays parallel to the triangle miss it.
+     *        With WATERTIGHT_TRIANGLE_TEST the test of Woop et al. is used, which never lets a ray
+     *        slip through the shared edge of two triangles.
+     * @param t u v The distance and the barycentric coordinates of the hit
+     */
+    static bool hitTest(const std::array<cv::Vec3f, 3> &vertices, const HitTestData &data, const Ray &ray, float &t, float &u, float &v);
+    // the same test for the active lanes of a packet, returns the mask of lanes that hit
+    static int hitTest(const std::array<cv::Vec3f, 3> &vertices, const HitTestData &data, const RayPacket &packet, int activeMask, float *t, float *u, float *v);
+    // the bounds of the parts of the triangle on both sides of a plane, see Object::splitAABB
+    static void clipAABB(const std::array<cv::Vec3f, 3> &vertices, int axis, float plane, const AABB &bound, AABB &left, AABB &right);
+
     static std::optional<std::vector<Triangle>> loadModel(const std::string &filepath);
 };
 
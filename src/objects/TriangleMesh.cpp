@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <stdexcept>
+#include "common/utils.h"
+#include "objects/Triangle.h"
+#include "objects/TriangleMesh.h"
+
+cv::Vec3f MeshSurface::getNormal(const cv::Vec3f &point) const
+{
+    throw std::runtime_error("MeshSurface::getNormal: the normal of a mesh hit is in its payload");
+}
+
+HitPayload MeshSurface::samplePoint() const
+{
+    throw std::runtime_error("MeshSurface::samplePoint: sample the mesh instead");
+}
+
+cv::Vec3f MeshSurface::getDiffuseColor(const cv::Vec2f &st) const
+{
+    if (getTexture() != nullptr)
+    {
+        int i = static_cast<int>(st[0] * getTexture()->rows);
+        int j = static_cast<int>(st[1] * getTexture()->cols);
+        return getTexture()->at<cv::Vec3f>(i, j) / 255;
+    }
+    return cv::Vec3f(1, 1, 1);
+}
+
+int TriangleMesh::addVertex(const cv::Vec3f &position, const cv::Vec2f &texCoord)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        m_positions[a].push_back(position[a]);
+    }
+    m_texCoords[0].push_back(texCoord[0]);
+    m_texCoords[1].push_back(texCoord[1]);
+    return getVertexCount() - 1;
+}
+
+int TriangleMesh::addSurface(std::shared_ptr<MeshSurface> surface)
+{
+    if (m_surfaces.size() > UINT16_MAX)
+    {
+        throw std::runtime_error("TriangleMesh::addSurface: too many surfaces");
+    }
+    m_surfaces.push_back(surface);
+    return m_surfaces.size() - 1;
+}
+
+void TriangleMesh::addFace(int v0, int v1, int v2, int surface)
+{
+    int vertexCount = getVertexCount();
+    if (v0 < 0 || v0 >= vertexCount || v1 < 0 || v1 >= vertexCount || v2 < 0 || v2 >= vertexCount
+        || surface < 0 || surface >= static_cast<int>(m_surfaces.size()))
+    {
+        throw std::out_of_range("TriangleMesh::addFace: vertex or surface index out of range");
+    }
+    m_indices.insert(m_indices.end(), {v0, v1, v2});
+    m_faceSurfaces.push_back(surface);
+
+    int face = getFaceCount() - 1;
+    m_bound = m_bound + getPrimitiveAABB(face);
+    if (m_surfaces[surface]->emissive())
+    {
+        auto vertices = getFaceVertices(face);
+        float area = 0.5 * cv::norm((vertices[1] - vertices[0]).cross(vertices[2] - vertices[0]));
+        m_emissiveFaces.push_back(face);
+        m_emissiveCdf.push_back((m_emissiveCdf.empty() ? 0 : m_emissiveCdf.back()) + area);
+    }
+}
+
+size_t TriangleMesh::getMemoryBytes() const
+{
+    size_t bytes = sizeof(TriangleMesh);
+    bytes += 3 * m_positions[0].capacity() * sizeof(float);
+    bytes += 2 * m_texCoords[0].capacity() * sizeof(float);
+    bytes += m_indices.capacity() * sizeof(int);
+    bytes += m_faceSurfaces.capacity() * sizeof(uint16_t);
+    bytes += m_surfaces.capacity() * sizeof(std::shared_ptr<MeshSurface>);
+    bytes += m_emissiveFaces.capacity() * sizeof(int) + m_emissiveCdf.capacity() * sizeof(float);
+    return bytes;
+}
+
+std::array<cv::Vec3f, 3> TriangleMesh::getFaceVertices(int face) const
+{
+    std::array<cv::Vec3f, 3> vertices;
+    for (int i = 0; i < 3; i++)
+    {
+        int index = m_indices[3 * face + i];
+        vertices[i] = cv::Vec3f(m_positions[0][index], m_positions[1][index], m_positions[2][index]);
+    }
+    return vertices;
+}
+
+std::optional<HitPayload> TriangleMesh::intersect(const Ray &ray) const
+{
+    Ray r = ray;
+    std::optional<HitPayload> closest;
+    for (int face = 0; face < getFaceCount(); face++)
+    {
+        auto hit = intersectPrimitive(r, face);
+        if (hit.has_value())
+        {
+            closest = hit;
+            r.setTMax(hit->dist);
+        }
+    }
+    return closest;
+}
+
+bool TriangleMesh::occluded(const Ray &ray) const
+{
+    for (int face = 0; face < getFaceCount(); face++)
+    {
+        if (occludedPrimitive(ray, face))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+AABB TriangleMesh::getPrimitiveAABB(int prim) const
+{
+    auto vertices = getFaceVertices(prim);
+    return AABB() + vertices[0] + vertices[1] + vertices[2];
+}
+
+void TriangleMesh::splitPrimitiveAABB(int prim, int axis, float plane, const AABB &bound, AABB &left, AABB &right) const
+{
+    Triangle::clipAABB(getFaceVertices(prim), axis, plane, bound, left, right);
+}
+
+std::optional<HitPayload> TriangleMesh::intersectPrimitive(const Ray &ray, int prim) const
+{
+    PrimitiveHit hit;
+    if (!hitPrimitive(ray, prim, hit))
+    {
+        return std::nullopt;
+    }
+    return makePrimitiveHit(ray, prim, hit);
+}
+
+bool TriangleMesh::occludedPrimitive(const Ray &ray, int prim) const
+{
+    float t, u, v;
+    auto vertices = getFaceVertices(prim);
+    return Triangle::hitTest(vertices, Triangle::precompute(vertices), ray, t, u, v);
+}
+
+bool TriangleMesh::hitPrimitive(const Ray &ray, int prim, PrimitiveHit &hit) const
+{
+    // the edges are derived on the fly, storing them would triple the memory of a face
+    auto vertices = getFaceVertices(prim);
+    if (!Triangle::hitTest(vertices, Triangle::precompute(vertices), ray, hit.t, hit.u, hit.v))
+    {
+        return false;
+    }
+    hit.emissive = getFaceSurface(prim)->emissive();
+    return true;
+}
+
+HitPayload TriangleMesh::makePrimitiveHit(const Ray &ray, int prim, const PrimitiveHit &hit) const
+{
+    const std::shared_ptr<MeshSurface> &surface = getFaceSurface(prim);
+    auto vertices = getFaceVertices(prim);
+    HitPayload res(cv::Vec2f(hit.u, hit.v), surface.get(), hit.t, surface->getEmission());
+    res.point = ray.getOrig() + hit.t * ray.getDir();
+    res.normal = cv::normalize((vertices[1] - vertices[0]).cross(vertices[2] - vertices[0]));
+    res.primIndex = prim;
+
+    cv::Vec2f st(0, 0);
+    for (int i = 0; i < 3; i++)
+    {
+        int index = m_indices[3 * prim + i];
+        float weight = i == 0 ? 1 - hit.u - hit.v : (i == 1 ? hit.u : hit.v);
+        st += weight * cv::Vec2f(m_texCoords[0][index], m_texCoords[1][index]);
+    }
+    res.st = cv::Vec2f(zoe::roundToUnit(st[0]), zoe::roundToUnit(st[1]));
+    return res;
+}
+
+int TriangleMesh::intersectPacket(const RayPacket &packet, int prim, int activeMask, PrimitiveHit *hits) const
+{
+    float tHit[RayPacket::maxSize];
+    float uHit[RayPacket::maxSize];
+    float vHit[RayPacket::maxSize];
+    auto vertices = getFaceVertices(prim);
+    int mask = Triangle::hitTest(vertices, Triangle::precompute(vertices), packet, activeMask, tHit, uHit, vHit);
+    bool isEmissive = getFaceSurface(prim)->emissive();
+    for (int i = 0; i < packet.size; i++)
+    {
+        if (mask >> i & 1)
+        {
+            hits[i].t = tHit[i];
+            hits[i].u = uHit[i];
+            hits[i].v = vHit[i];
+            hits[i].emissive = isEmissive;
+        }
+    }
+    return mask;
+}
+
+cv::Vec3f TriangleMesh::getNormal(const cv::Vec3f &point) const
+{
+    throw std::runtime_error("TriangleMesh::getNormal: the normal of a mesh hit is in its payload");
+}
+
+float TriangleMesh::getArea() const
+{
+    return m_emissiveCdf.empty() ? 0 : m_emissiveCdf.back();
+}
+
+HitPayload TriangleMesh::samplePoint() const
+{
+    if (m_emissiveFaces.empty())
+    {
+        throw std::runtime_error("TriangleMesh::samplePoint: the mesh has no emissive face");
+    }
+    // pick a face proportional to its area, then a uniform point on it
+    float target = zoe::randomFloat() * m_emissiveCdf.back();
+    size_t i = std::upper_bound(m_emissiveCdf.begin(), m_emissiveCdf.end(), target) - m_emissiveCdf.begin();
+    int face = m_emissiveFaces[std::min(i, m_emissiveFaces.size() - 1)];
+
+    auto vertices = getFaceVertices(face);
+    float x = std::sqrt(zoe::randomFloat());
+    float y = zoe::randomFloat();
+    const std::shared_ptr<MeshSurface> &surface = getFaceSurface(face);
+    HitPayload payload;
+    payload.point = (1 - x) * vertices[0] + x * (1 - y) * vertices[1] + x * y * vertices[2];
+    payload.normal = cv::normalize((vertices[1] - vertices[0]).cross(vertices[2] - vertices[0]));
+    payload.hitObj = surface.get();
+    payload.emission = surface->getEmission();
+    payload.primIndex = face;
+    return payload;
+}
+
+uint64_t TriangleMesh::getGeometryHash() const
+{
+    uint64_t hash = zoe::hashBytes(m_indices.data(), m_indices.size() * sizeof(int));
+    for (int a = 0; a < 3; a++)
+    {
+        hash = zoe::hashBytes(m_positions[a].data(), m_positions[a].size() * sizeof(float), hash);
+    }
+    return hash;
+}
@@ -0,0 +1,99 @@
+#ifndef __OBJECTS_TRIANGLEMESH_H__
+#define __OBJECTS_TRIANGLEMESH_H__
+
+#include <array>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include "objects/Object.h"
+
+/**
+ * @brief The material and texture of a group of mesh faces. It is the hit object of a mesh hit,
+ *        the face itself is in HitPayload::primIndex and its texture coordinates in HitPayload::st.
+ */
+class MeshSurface : public Object
+{
+public:
+    MeshSurface() = default;
+    MeshSurface(const Material &material) : Object(cv::Vec3f(0, 0, 0), material) { }
+
+    // a surface has no geometry of its own, the mesh answers these
+    virtual std::optional<HitPayload> intersect(const Ray &ray) const override { return std::nullopt; }
+    virtual AABB getAABB() const override { return AABB(); }
+    virtual cv::Vec3f getNormal(const cv::Vec3f &point) const override;
+    virtual float getArea() const override { return 0; }
+    virtual HitPayload samplePoint() const override;
+    virtual cv::Vec2f getTexCoords(const cv::Vec2f &uv) const override { return uv; }
+
+    virtual cv::Vec3f getDiffuseColor(const cv::Vec2f &st) const override;
+};
+
+/**
+ * @brief Indexed triangle mesh. Vertex positions and texture coordinates live in shared SoA buffers,
+ *        every face stores three vertex indices and the index of its surface.
+ *        The BVH builds over the faces directly, see Object::getPrimitiveCount.
+ */
+class TriangleMesh : public Object
+{
+private:
+    // vertex buffers, one array per component
+    std::vector<float> m_positions[3];
+    std::vector<float> m_texCoords[2];
+    // three vertex indices per face
+    std::vector<int> m_indices;
+    std::vector<uint16_t> m_faceSurfaces;
+    std::vector<std::shared_ptr<MeshSurface>> m_surfaces;
+    // emissive faces and their cumulative areas, sampled when the mesh acts as a light
+    std::vector<int> m_emissiveFaces;
+    std::vector<float> m_emissiveCdf;
+    AABB m_bound;
+
+    std::array<cv::Vec3f, 3> getFaceVertices(int face) const;
+
+public:
+    TriangleMesh() = default;
+
+    /**
+     * @return The index of the new vertex
+     */
+    int addVertex(const cv::Vec3f &position, const cv::Vec2f &texCoord = cv::Vec2f(0, 0));
+
+    /**
+     * @return The index of the surface, to be passed to addFace
+     */
+    int addSurface(std::shared_ptr<MeshSurface> surface);
+
+    void addFace(int v0, int v1, int v2, int surface);
+
+    int getVertexCount() const { return m_positions[0].size(); }
+    int getFaceCount() const { return m_faceSurfaces.size(); }
+    const std::shared_ptr<MeshSurface> &getFaceSurface(int face) const { return m_surfaces[m_faceSurfaces[face]]; }
+    size_t getMemoryBytes() const;
+
+    // brute force over all faces, the BVH intersects the faces one by one instead
+    virtual std::optional<HitPayload> intersect(const Ray &ray) const override;
+    virtual bool occluded(const Ray &ray) const override;
+    virtual AABB getAABB() const override { return m_bound; }
+
+    virtual int getPrimitiveCount() const override { return getFaceCount(); }
+    virtual AABB getPrimitiveAABB(int prim) const override;
+    virtual void splitPrimitiveAABB(int prim, int axis, float plane, const AABB &bound, AABB &left, AABB &right) const override;
+    virtual std::optional<HitPayload> intersectPrimitive(const Ray &ray, int prim) const override;
+    virtual bool occludedPrimitive(const Ray &ray, int prim) const override;
+    virtual bool hitPrimitive(const Ray &ray, int prim, PrimitiveHit &hit) const override;
+    virtual HitPayload makePrimitiveHit(const Ray &ray, int prim, const PrimitiveHit &hit) const override;
+    virtual int intersectPacket(const RayPacket &packet, int prim, int activeMask, PrimitiveHit *hits) const override;
+    virtual bool getPrimitiveTriangle(int prim, std::array<cv::Vec3f, 3> &vertices) const override { vertices = getFaceVertices(prim); return true; }
+    virtual bool isPrimitiveEmissive(int prim) const override { return getFaceSurface(prim)->emissive(); }
+
+    // the normal comes with the hit payload
+    virtual cv::Vec3f getNormal(const cv::Vec3f &point) const override;
+    // area of the emissive faces, the part of the mesh that is sampled as a light
+    virtual float getArea() const override;
+    virtual HitPayload samplePoint() const override;
+    virtual cv::Vec2f getTexCoords(const cv::Vec2f &uv) const override { return uv; }
+    virtual bool emissive() const override { return !m_emissiveFaces.empty(); }
+    virtual uint64_t getGeometryHash() const override;
+};
+
+#endif
@@ -1,6 +1,19 @@
 #include "common/AABB.h"
+#include "common/utils.h"
+
+void testSingle();
+void testZeroDirection();
+void testTouching();
 
 int main()
+{
+    testSingle();
+    testZeroDirection();
+    testTouching();
+    return 0;
+}
+
+void testSingle()
 {
     AABB aabb(cv::Vec3f(-5, -3, -16), cv::Vec3f(5, -3, -6));
     bool res = aabb.intersect(Ray(cv::Vec3f(0, 0, 0), cv::Vec3f(0.109375, -0.338542, -1)));
@@ -13,6 +26,107 @@ int main()
     {
         std::cout << "Miss!" << std::endl;
     }
+}
 
-    return 0;
-}
\ No newline at end of file
+void testZeroDirection()
+{
+    std::cout << "========== testZeroDirection ==========" << std::endl;
+    AABB aabb(cv::Vec3f(0, 0, 0), cv::Vec3f(1, 1, 1));
+    struct Case
+    {
+        const char *name;
+        Ray ray;
+        bool expected;
+    };
+    // a zero component gives infinite slab distances, or NaN when the origin lies on that slab's plane
+    const Case cases[] = {
+        { "inside the y and z slabs", Ray(cv::Vec3f(-1, 0.5, 0.5), cv::Vec3f(1, 0, 0)), true },
+        { "outside the y slab", Ray(cv::Vec3f(-1, 2, 0.5), cv::Vec3f(1, 0, 0)), false },
+        { "on the min y plane", Ray(cv::Vec3f(-1, 0, 0.5), cv::Vec3f(1, 0, 0)), true },
+        { "on the max y plane", Ray(cv::Vec3f(-1, 1, 0.5), cv::Vec3f(1, 0, 0)), true },
+        { "on a box edge", Ray(cv::Vec3f(-1, 1, 1), cv::Vec3f(1, 0, 0)), true },
+        { "negative zero components", Ray(cv::Vec3f(2, 0.5, 0.5), cv::Vec3f(-1, -0.0f, -0.0f)), true },
+        { "along the axis away from the box", Ray(cv::Vec3f(2, 0.5, 0.5), cv::Vec3f(1, 0, 0)), false },
+        { "single axis, origin inside", Ray(cv::Vec3f(0.5, 0.5, 0.5), cv::Vec3f(0, 0, -1)), true },
+    };
+    int mismatches = 0;
+    for (const Case &c : cases)
+    {
+        bool res = aabb.intersect(c.ray);
+        mismatches += res != c.expected;
+        std::cout << c.name << ": " << (res ? "Hit" : "Miss") << (res != c.expected ? " (wrong)" : "") << std::endl;
+    }
+    std::cout << "mismatches " << mismatches << std::endl;
+}
+
+namespace {
+
+// the slab test in double precision on the ray as stored, the reference for touching rays
+bool referenceHit(const AABB &aabb, const Ray &ray)
+{
+    double enter = ray.getTMin();
+    double exit = ray.getTMax();
+    for (int a = 0; a < 3; a++)
+    {
+        double o = ray.getOrig()[a];
+        double d = ray.getDir()[a];
+        if (d == 0)
+        {
+            if (o < aabb.getMin()[a] || o > aabb.getMax()[a])
+            {
+                return false;
+            }
+            continue;
+        }
+        double t0 = (aabb.getMin()[a] - o) / d;
+        double t1 = (aabb.getMax()[a] - o) / d;
+        enter = std::max(enter, std::min(t0, t1));
+        exit = std::min(exit, std::max(t0, t1));
+    }
+    return enter <= exit;
+}
+
+}
+
+void testTouching()
+{
+    std::cout << "========== testTouching ==========" << std::endl;
+    AABB aabb(cv::Vec3f(-0.3f, 1.7f, -5.1f), cv::Vec3f(2.9f, 4.3f, -0.7f));
+    const cv::Vec3f &lo = aabb.getMin();
+    cv::Vec3f diagonal = aabb.getDiagonal();
+
+    // rays from outside towards a point on a face, an edge or a corner, rounding must not reject them
+    int hits[3] = { 0, 0, 0 };
+    int misses[3] = { 0, 0, 0 };
+    const int n = 100000;
+    for (int i = 0; i < n; i++)
+    {
+        for (int fixed = 1; fixed <= 3; fixed++)
+        {
+            // `fixed` axes of the target are pinned to a bound, the others are random
+            cv::Vec3f target;
+            int axis = static_cast<int>(zoe::randomFloat() * 3) % 3;
+            for (int k = 0; k < 3; k++)
+            {
+                int a = (axis + k) % 3;
+                float s = k < fixed ? static_cast<float>(zoe::randomFloat() < 0.5f) : zoe::randomFloat();
+                target[a] = lo[a] + diagonal[a] * s;
+            }
+            cv::Vec3f dir = cv::Vec3f(zoe::randomFloat(), zoe::randomFloat(), zoe::randomFloat()) * 2 - cv::Vec3f(1, 1, 1);
+            cv::Vec3f orig = target - dir * 10;
+            // the stored ray may pass just beside an edge or a corner after rounding, so it is judged as stored
+            Ray ray(orig, target - orig);
+            if (referenceHit(aabb, ray))
+            {
+                hits[fixed - 1]++;
+                misses[fixed - 1] += !aabb.intersect(ray);
+            }
+        }
+    }
+    std::cout << "misses on faces " << misses[0] << " / " << hits[0] << ", edges " << misses[1] << " / " << hits[1] 
+        << ", corners " << misses[2] << " / " << hits[2] << std::endl;
+
+    // the slab exit padding is relative, a ray stopping clearly short of the box still misses
+    Ray shortRay(cv::Vec3f(-1.3f, 3, -3), cv::Vec3f(1, 0, 0), 0.999f);
+    std::cout << "stopping short: " << (aabb.intersect(shortRay) ? "Hit (wrong)" : "Miss") << std::endl;
+}
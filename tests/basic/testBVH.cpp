@@ -1,19 +1,63 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
 #include "common/BVH.h"
 #include "common/Camera.h"
+#include "common/TriangleBlock.h"
+#include "common/utils.h"
+#include "common/WideBVH.h"
+#include "objects/Instance.h"
 #include "objects/Sphere.h"
 #include "objects/Triangle.h"
+#include "objects/TriangleMesh.h"
 #include "Scene.h"
 #include "Renderer.h"
 
 void testSingle();
 void testSphereBVH();
 void testTriangleBVH();
+void testSAHReport();
+void testInstancing();
+void testRefit();
+void testQuantizedReport();
+void testRayPacket();
+void testMeshReport();
+void testTriangleKernel();
+void testTriangleBlocks();
+void testDeferredHit();
+void testDepthLimit();
+void testSpatialSplits();
+void testCacheCorruption();
+
+namespace {
+
+// a ray from a random point around bound towards a random point inside it
+Ray randomRay(const AABB &bound)
+{
+    cv::Vec3f orig = bound.getMin() + bound.getDiagonal().mul(cv::Vec3f(zoe::randomFloat(), zoe::randomFloat(), zoe::randomFloat())) * 3 - bound.getDiagonal();
+    cv::Vec3f target = bound.getMin() + bound.getDiagonal().mul(cv::Vec3f(zoe::randomFloat(), zoe::randomFloat(), zoe::randomFloat()));
+    return Ray(orig, target - orig);
+}
+
+}
 
 int main()
 {
     testSingle();
     testSphereBVH();
     testTriangleBVH();
+    testSAHReport();
+    testInstancing();
+    testRefit();
+    testQuantizedReport();
+    testRayPacket();
+    testMeshReport();
+    testTriangleKernel();
+    testTriangleBlocks();
+    testDeferredHit();
+    testDepthLimit();
+    testSpatialSplits();
+    testCacheCorruption();
     return 0;
 }
 
@@ -23,12 +67,14 @@ void testSingle()
     std::shared_ptr<Object> sph2 = std::make_shared<Sphere>(cv::Vec3f(1, 1, 1), 1.0);
     std::vector<std::shared_ptr<Object>> objects = { sph1, sph2 };
     BVH bvh(objects);
-    std::shared_ptr<BVH::BVHNode> res = bvh.getRoot();
-    std::cout << "res = " << res->aabb << std::endl;
-    if (res->left != nullptr)
-        std::cout << "left = " << res->left->aabb << std::endl;
-    if (res->right != nullptr)
-        std::cout << "right = " << res->right->aabb << std::endl;
+    const std::vector<BVH::LinearBVHNode> &nodes = bvh.getNodes();
+    const BVH::LinearBVHNode &res = nodes[0];
+    std::cout << "res = " << res.aabb << std::endl;
+    if (res.nPrimitives == 0)
+    {
+        std::cout << "left = " << nodes[1].aabb << std::endl;
+        std::cout << "right = " << nodes[res.secondChildOffset].aabb << std::endl;
+    }
 }
 
 void testSphereBVH()
@@ -69,4 +115,753 @@ void testTriangleBVH()
         scene.add(std::make_shared<Triangle>(tri));
     }
     scene.buildBVH();
-}
\ No newline at end of file
+}
+
+void testSAHReport()
+{
+    std::cout << "========== testSAHReport ==========" << std::endl;
+    std::optional<std::vector<Triangle>> triangles = Triangle::loadModel("models/bunny/bunny.obj");
+    if (!triangles.has_value())
+    {
+        std::cout << "Failed to load model" << std::endl;
+        return;
+    }
+
+    std::vector<std::shared_ptr<Object>> objects;
+    for (const auto &tri : triangles.value())
+    {
+        objects.push_back(std::make_shared<Triangle>(tri));
+    }
+
+    BVHBuildConfig median;
+    median.splitMethod = BVHBuildConfig::SplitMethod::MEDIAN;
+    BVHBuildConfig sah;
+    sah.splitMethod = BVHBuildConfig::SplitMethod::SAH;
+
+    float medianCost = BVH(objects, median).getSAHCost();
+    float sahCost = BVH(objects, sah).getSAHCost();
+    std::cout << "median SAH cost = " << medianCost << std::endl;
+    std::cout << "binned SAH cost = " << sahCost << " (" << sahCost / medianCost * 100 << "% of median)" << std::endl;
+
+    BVHBuildConfig morton;
+    for (auto method : { BVHBuildConfig::SplitMethod::LBVH, BVHBuildConfig::SplitMethod::HLBVH })
+    {
+        morton.splitMethod = method;
+        BVH bvh(objects, morton);
+        std::cout << (method == BVHBuildConfig::SplitMethod::LBVH ? "LBVH" : "HLBVH") << " SAH cost = " << bvh.getSAHCost() 
+            << ", built in " << bvh.getBuildTimes().build << " ms" << std::endl;
+    }
+}
+
+void testInstancing()
+{
+    std::cout << "========== testInstancing ==========" << std::endl;
+    std::optional<std::vector<Triangle>> triangles = Triangle::loadModel("models/bunny/bunny.obj");
+    if (!triangles.has_value())
+    {
+        std::cout << "Failed to load model" << std::endl;
+        return;
+    }
+
+    std::vector<std::shared_ptr<Object>> mesh;
+    for (const auto &tri : triangles.value())
+    {
+        mesh.push_back(std::make_shared<Triangle>(tri));
+    }
+    std::shared_ptr<const BVH> blas = std::make_shared<BVH>(mesh);
+
+    // two copies: one translated, one rotated about y and scaled by 2
+    std::vector<cv::Matx44f> transforms = {
+        cv::Matx44f(1, 0, 0, 0.3, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1),
+        cv::Matx44f(0, 0, 2, -0.3, 0, 2, 0, 0, -2, 0, 0, 0, 0, 0, 0, 1)
+    };
+    std::vector<std::shared_ptr<Object>> instances;
+    std::vector<std::shared_ptr<Object>> flattened;
+    for (const cv::Matx44f &m : transforms)
+    {
+        instances.push_back(std::make_shared<Instance>(blas, m));
+        for (const auto &tri : triangles.value())
+        {
+            std::array<cv::Vec3f, 3> vertices;
+            for (int i = 0; i < 3; i++)
+            {
+                cv::Vec4f v = m * cv::Vec4f(tri.getVertex(i)[0], tri.getVertex(i)[1], tri.getVertex(i)[2], 1);
+                vertices[i] = cv::Vec3f(v[0], v[1], v[2]);
+            }
+            flattened.push_back(std::make_shared<Triangle>(vertices));
+        }
+    }
+    BVH tlas(instances);
+    BVH reference(flattened);
+
+    AABB bound = reference.getNodes()[0].aabb;
+    int mismatches = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        cv::Vec3f target = bound.getMin() + bound.getDiagonal().mul(cv::Vec3f(zoe::randomFloat(), zoe::randomFloat(), zoe::randomFloat()));
+        Ray ray(cv::Vec3f(0, 0.1, 2), target - cv::Vec3f(0, 0.1, 2));
+        std::optional<HitPayload> a = tlas.intersect(ray);
+        std::optional<HitPayload> b = reference.intersect(ray);
+        if (a.has_value() != b.has_value() 
+            || (a.has_value() && (std::abs(a->dist - b->dist) > 1e-4 || std::abs(a->normal.dot(b->normal)) < 0.999)))
+        {
+            mismatches++;
+        }
+    }
+    std::cout << "instanced vs flattened mismatches = " << mismatches << " / 1000" << std::endl;
+}
+
+void testRefit()
+{
+    std::cout << "========== testRefit ==========" << std::endl;
+    std::optional<std::vector<Triangle>> triangles = Triangle::loadModel("models/bunny/bunny.obj");
+    if (!triangles.has_value())
+    {
+        std::cout << "Failed to load model" << std::endl;
+        return;
+    }
+
+    std::vector<std::shared_ptr<Triangle>> mesh;
+    std::vector<std::shared_ptr<Object>> objects;
+    for (const auto &tri : triangles.value())
+    {
+        mesh.push_back(std::make_shared<Triangle>(tri));
+        objects.push_back(mesh.back());
+    }
+    BVH bvh(objects);
+    AABB bound = bvh.getNodes()[0].aabb;
+
+    // a growing wave along x, every frame refits and checks the result against brute force
+    for (int frame = 1; frame <= 8; frame++)
+    {
+        float amplitude = 0.01f * frame;
+        for (size_t t = 0; t < mesh.size(); t++)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                cv::Vec3f v = triangles.value()[t].getVertex(i);
+                v[1] += amplitude * std::sin(v[0] * 60);
+                mesh[t]->setVertex(i, v);
+            }
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        bool keep = bvh.refit();
+        auto end = std::chrono::high_resolution_clock::now();
+        float growth = bvh.getSAHGrowth();
+        if (!keep)
+        {
+            bvh = BVH(objects);
+        }
+
+        int mismatches = 0;
+        for (int i = 0; i < 200; i++)
+        {
+            Ray ray = randomRay(bound);
+            std::optional<HitPayload> a = bvh.intersect(ray);
+            std::optional<HitPayload> b;
+            for (const auto &obj : objects)
+            {
+                std::optional<HitPayload> hit = obj->intersect(ray);
+                if (hit.has_value() && (!b.has_value() || hit->dist < b->dist))
+                {
+                    b = hit;
+                }
+            }
+            if (a.has_value() != b.has_value() || (a.has_value() && std::abs(a->dist - b->dist) > 1e-5))
+            {
+                mismatches++;
+            }
+        }
+        std::cout << "frame " << frame << ": refit " << std::chrono::duration<double, std::milli>(end - start).count() << " ms, SAH growth " << growth 
+            << (keep ? "" : ", rebuilt") << ", mismatches " << mismatches << " / 200" << std::endl;
+    }
+}
+
+void testQuantizedReport()
+{
+    std::cout << "========== testQuantizedReport ==========" << std::endl;
+    for (const std::string model : { "models/bunny/bunny.obj", "models/stairscase/stairscase.obj" })
+    {
+        std::optional<std::vector<Triangle>> triangles = Triangle::loadModel(model);
+        if (!triangles.has_value())
+        {
+            std::cout << "Failed to load model" << std::endl;
+            continue;
+        }
+
+        std::vector<std::shared_ptr<Object>> objects;
+        for (const auto &tri : triangles.value())
+        {
+            objects.push_back(std::make_shared<Triangle>(tri));
+        }
+        std::shared_ptr<const BVH> bvh = std::make_shared<BVH>(objects);
+        AABB bound = bvh->getNodes()[0].aabb;
+        std::vector<Ray> rays;
+        for (int i = 0; i < 100000; i++)
+        {
+            rays.push_back(randomRay(bound));
+        }
+
+        std::vector<float> expected(rays.size(), -1);
+        for (size_t i = 0; i < rays.size(); i++)
+        {
+            std::optional<HitPayload> hit = bvh->intersect(rays[i]);
+            expected[i] = hit.has_value() ? hit->dist : -1;
+        }
+
+        // every layout must return exactly the hits of the binary BVH
+        auto report = [&](const std::string &name, const auto &wide) {
+            std::vector<float> dist(rays.size(), -1);
+            auto start = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < rays.size(); i++)
+            {
+                std::optional<HitPayload> hit = wide.intersect(rays[i]);
+                dist[i] = hit.has_value() ? hit->dist : -1;
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            int mismatches = 0;
+            for (size_t i = 0; i < rays.size(); i++)
+            {
+                mismatches += dist[i] != expected[i];
+            }
+            std::cout << name << ": " << wide.getNodeCount() << " nodes, " << wide.getMemoryBytes() / 1024.0 << " KiB, "
+                << std::chrono::duration<double, std::milli>(end - start).count() << " ms, mismatches " << mismatches << std::endl;
+        };
+        std::cout << model << std::endl;
+        report("BVH4", BVH4(bvh));
+        report("BVH4 quantized", BVH4(bvh, true));
+        report("BVH8", BVH8(bvh));
+        report("BVH8 quantized", BVH8(bvh, true));
+    }
+}
+
+void testRayPacket()
+{
+    std::cout << "========== testRayPacket ==========" << std::endl;
+    std::optional<std::vector<Triangle>> triangles = Triangle::loadModel("models/bunny/bunny.obj");
+    if (!triangles.has_value())
+    {
+        std::cout << "Failed to load model" << std::endl;
+        return;
+    }
+
+    std::vector<std::shared_ptr<Object>> objects;
+    for (const auto &tri : triangles.value())
+    {
+        objects.push_back(std::make_shared<Triangle>(tri));
+    }
+    BVH bvh(objects);
+    AABB bound = bvh.getNodes()[0].aabb;
+
+    // a 512x512 camera looking at the model, tiles of 2x2, 4x2 and 4x4 pixels
+    int res = 512;
+    cv::Vec3f eye = bound.getMin() + bound.getDiagonal() * 0.5 + cv::Vec3f(0, 0, 2 * cv::norm(bound.getDiagonal()));
+    std::vector<Ray> rays;
+    for (int j = 0; j < res; j++)
+    {
+        for (int i = 0; i < res; i++)
+        {
+            cv::Vec3f target = bound.getMin() + bound.getDiagonal().mul(cv::Vec3f((i + 0.5f) / res, (j + 0.5f) / res, 0.5f));
+            rays.emplace_back(eye, target - eye);
+        }
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::optional<HitPayload>> expected(rays.size());
+    for (size_t i = 0; i < rays.size(); i++)
+    {
+        expected[i] = bvh.intersect(rays[i]);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "single rays: " << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+
+    for (int size : { 4, 8, 16 })
+    {
+        int tileWidth = size == 4 ? 2 : 4;
+        int tileHeight = size / tileWidth;
+        int mismatches = 0;
+        start = std::chrono::high_resolution_clock::now();
+        for (int tj = 0; tj < res; tj += tileHeight)
+        {
+            for (int ti = 0; ti < res; ti += tileWidth)
+            {
+                RayPacket packet(size);
+                for (int lane = 0; lane < size; lane++)
+                {
+                    packet.setRay(lane, rays[(tj + lane / tileWidth) * res + ti + lane % tileWidth]);
+                }
+                std::optional<HitPayload> hits[RayPacket::maxSize];
+                bvh.intersect(packet, hits);
+                for (int lane = 0; lane < size; lane++)
+                {
+                    const std::optional<HitPayload> &e = expected[(tj + lane / tileWidth) * res + ti + lane % tileWidth];
+                    mismatches += hits[lane].has_value() != e.has_value() || (e.has_value() && hits[lane]->dist != e->dist);
+                }
+            }
+        }
+        end = std::chrono::high_resolution_clock::now();
+        std::cout << size << "-ray packets: " << std::chrono::duration<double, std::milli>(end - start).count() << " ms, mismatches " << mismatches << std::endl;
+    }
+
+    // incoherent packets take the single-ray path
+    int mismatches = 0;
+    for (int n = 0; n < 1000; n++)
+    {
+        RayPacket packet(8);
+        std::vector<Ray> lanes;
+        for (int lane = 0; lane < 8; lane++)
+        {
+            lanes.push_back(randomRay(bound));
+            packet.setRay(lane, lanes.back());
+        }
+        std::optional<HitPayload> hits[RayPacket::maxSize];
+        bvh.intersect(packet, hits);
+        for (int lane = 0; lane < 8; lane++)
+        {
+            std::optional<HitPayload> e = bvh.intersect(lanes[lane]);
+            mismatches += hits[lane].has_value() != e.has_value() || (e.has_value() && hits[lane]->dist != e->dist);
+        }
+    }
+    std::cout << "incoherent packets: mismatches " << mismatches << " / 8000" << std::endl;
+}
+
+void testMeshReport()
+{
+    std::cout << "========== testMeshReport ==========" << std::endl;
+    for (const std::string model : { "models/bunny/bunny.obj", "models/stairscase/stairscase.obj" })
+    {
+        std::optional<std::vector<Triangle>> triangles = Triangle::loadModel(model);
+        if (!triangles.has_value())
+        {
+            std::cout << "Failed to load model" << std::endl;
+            continue;
+        }
+
+        // the same faces once as triangle objects and once as one mesh sharing its vertices
+        std::vector<std::shared_ptr<Object>> objects;
+        auto mesh = std::make_shared<TriangleMesh>();
+        int surface = mesh->addSurface(std::make_shared<MeshSurface>());
+        std::map<std::array<float, 3>, int> vertices;
+        for (const auto &tri : triangles.value())
+        {
+            objects.push_back(std::make_shared<Triangle>(tri));
+            std::array<int, 3> face;
+            for (int i = 0; i < 3; i++)
+            {
+                const cv::Vec3f &p = tri.getVertex(i);
+                auto it = vertices.find({ p[0], p[1], p[2] });
+                if (it == vertices.end())
+                {
+                    it = vertices.emplace(std::array<float, 3>{ p[0], p[1], p[2] }, mesh->addVertex(p)).first;
+                }
+                face[i] = it->second;
+            }
+            mesh->addFace(face[0], face[1], face[2], surface);
+        }
+        BVH bvh(objects);
+        BVH meshBVH({ mesh });
+
+        AABB bound = bvh.getNodes()[0].aabb;
+        std::vector<Ray> rays;
+        for (int i = 0; i < 100000; i++)
+        {
+            rays.push_back(randomRay(bound));
+        }
+
+        auto trace = [&rays](const BVH &b, std::vector<float> &dist) {
+            dist.assign(rays.size(), -1);
+            auto start = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < rays.size(); i++)
+            {
+                std::optional<HitPayload> hit = b.intersect(rays[i]);
+                dist[i] = hit.has_value() ? hit->dist : -1;
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            return std::chrono::duration<double, std::milli>(end - start).count();
+        };
+        std::vector<float> expected, dist;
+        double triangleTime = trace(bvh, expected);
+        double meshTime = trace(meshBVH, dist);
+        int mismatches = 0;
+        for (size_t i = 0; i < rays.size(); i++)
+        {
+            mismatches += dist[i] != expected[i];
+        }
+
+        // a triangle object lives in its own shared_ptr allocation next to its control block
+        size_t triangleBytes = objects.size() * (sizeof(Triangle) + 2 * sizeof(long)) + bvh.getStats().memoryBytes;
+        size_t meshBytes = mesh->getMemoryBytes() + meshBVH.getStats().memoryBytes;
+        std::cout << model << ": " << mesh->getFaceCount() << " faces, " << mesh->getVertexCount() << " vertices" << std::endl;
+        std::cout << "triangles: " << triangleBytes / 1024.0 << " KiB, " << triangleTime << " ms" << std::endl;
+        std::cout << "mesh: " << meshBytes / 1024.0 << " KiB, " << meshTime << " ms, mismatches " << mismatches << std::endl;
+    }
+}
+
+void testTriangleKernel()
+{
+    std::cout << "========== testTriangleKernel ==========" << std::endl;
+    std::optional<std::vector<Triangle>> triangles = Triangle::loadModel("models/bunny/bunny.obj");
+    if (!triangles.has_value())
+    {
+        std::cout << "Failed to load model" << std::endl;
+        return;
+    }
+
+    std::vector<std::array<cv::Vec3f, 3>> vertices;
+    std::vector<Triangle::HitTestData> data;
+    AABB bound;
+    for (const auto &tri : triangles.value())
+    {
+        vertices.push_back({ tri.getVertex(0), tri.getVertex(1), tri.getVertex(2) });
+        data.push_back(Triangle::precompute(vertices.back()));
+        bound = bound + tri.getAABB();
+    }
+    std::vector<Ray> rays;
+    for (int i = 0; i < 1000; i++)
+    {
+        rays.push_back(randomRay(bound));
+    }
+
+    // every ray against every triangle, with the stored record and with one derived per test as a mesh does
+    auto report = [&](const std::string &name, bool stored) {
+        int hits = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (const Ray &ray : rays)
+        {
+            for (size_t i = 0; i < vertices.size(); i++)
+            {
+                float t, u, v;
+                hits += Triangle::hitTest(vertices[i], stored ? data[i] : Triangle::precompute(vertices[i]), ray, t, u, v);
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        double tests = static_cast<double>(rays.size()) * vertices.size();
+        std::cout << name << ": " << tests / std::chrono::duration<double>(end - start).count() / 1e6 << " M tests/s, " << hits << " hits" << std::endl;
+    };
+    std::cout << "watertight: " << (WATERTIGHT_TRIANGLE_TEST ? "on" : "off") << std::endl;
+    report("precomputed", true);
+    report("on the fly", false);
+
+    // rays through the diagonal shared by the two triangles of a quad should never slip through
+    int misses = 0;
+    std::array<cv::Vec3f, 4> quad = { cv::Vec3f(0, 0, 0), cv::Vec3f(1.3, 0.1, 0.2), cv::Vec3f(1.7, 1.1, 0.4), cv::Vec3f(0.4, 1, 0.2) };
+    std::array<cv::Vec3f, 3> left = { quad[0], quad[1], quad[2] };
+    std::array<cv::Vec3f, 3> right = { quad[0], quad[2], quad[3] };
+    for (int i = 0; i < 1000000; i++)
+    {
+        cv::Vec3f target = quad[0] + zoe::randomFloat() * (quad[2] - quad[0]);
+        cv::Vec3f orig = target + cv::Vec3f(zoe::randomFloat() - 0.5f, zoe::randomFloat() - 0.5f, 2 + zoe::randomFloat());
+        Ray ray(orig, target - orig);
+        float t, u, v;
+        misses += !Triangle::hitTest(left, Triangle::precompute(left), ray, t, u, v) && !Triangle::hitTest(right, Triangle::precompute(right), ray, t, u, v);
+    }
+    std::cout << "rays slipping through a shared edge: " << misses << " / 1000000" << std::endl;
+}
+
+void testTriangleBlocks()
+{
+    std::cout << "========== testTriangleBlocks ==========" << std::endl;
+    std::optional<std::vector<Triangle>> triangles = Triangle::loadModel("models/bunny/bunny.obj");
+    if (!triangles.has_value())
+    {
+        std::cout << "Failed to load model" << std::endl;
+        return;
+    }
+
+    // consecutive triangles of the model packed two blocks at a time, the last pair may be partly empty
+    constexpr int width = TriangleBlock::width;
+    std::vector<std::array<cv::Vec3f, 3>> vertices;
+    std::vector<TriangleBlock> blocks;
+    std::vector<std::shared_ptr<Object>> objects;
+    AABB bound;
+    for (const auto &tri : triangles.value())
+    {
+        vertices.push_back({ tri.getVertex(0), tri.getVertex(1), tri.getVertex(2) });
+        if ((vertices.size() - 1) % width == 0)
+        {
+            blocks.emplace_back();
+        }
+        blocks.back().setTriangle((vertices.size() - 1) % width, vertices.back(), false);
+        objects.push_back(std::make_shared<Triangle>(tri));
+        bound = bound + tri.getAABB();
+    }
+    if (blocks.size() % 2)
+    {
+        blocks.emplace_back();
+    }
+    std::vector<Ray> rays;
+    for (int i = 0; i < 1000; i++)
+    {
+        rays.push_back(randomRay(bound));
+    }
+
+    // the SIMD kernel must agree bit for bit with Triangle::hitTest and with the scalar fallback
+    int mismatches = 0;
+    int hits = 0;
+    for (const Ray &ray : rays)
+    {
+        for (size_t b = 0; b < blocks.size(); b += 2)
+        {
+            float t[2 * width], u[2 * width], v[2 * width];
+            float ts[2 * width], us[2 * width], vs[2 * width];
+            int closest, closestScalar;
+            int mask = TriangleBlock::intersect(&blocks[b], 2, ray, t, u, v, closest);
+            int maskScalar = TriangleBlock::intersectScalar(&blocks[b], 2, ray, ts, us, vs, closestScalar);
+            mismatches += mask != maskScalar || closest != closestScalar;
+            for (int i = 0; i < 2 * width; i++)
+            {
+                size_t index = b * width + i;
+                float tRef = 0, uRef = 0, vRef = 0;
+                bool hit = index < vertices.size()
+                    && Triangle::hitTest(vertices[index], Triangle::precompute(vertices[index]), ray, tRef, uRef, vRef);
+                hits += hit;
+                mismatches += hit != static_cast<bool>(mask >> i & 1);
+                if (hit && (mask >> i & 1))
+                {
+                    mismatches += t[i] != tRef || u[i] != uRef || v[i] != vRef || ts[i] != tRef || us[i] != uRef || vs[i] != vRef;
+                }
+            }
+        }
+    }
+    std::cout << "AVX2: " << (zoe::cpuSupportsAVX2() ? "yes" : "no") << ", hits " << hits << ", mismatches " << mismatches << std::endl;
+
+    // leaves of up to 8 triangles traced with and without the blocks
+    auto report = [&](bool useBlocks, std::vector<float> &dists) {
+        BVHBuildConfig config;
+        config.maxLeafSize = 8;
+        config.triangleBlocks = useBlocks;
+        BVH bvh(objects, config);
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int pass = 0; pass < 10; pass++)
+        {
+            dists.clear();
+            for (const Ray &ray : rays)
+            {
+                std::optional<HitPayload> hit = bvh.intersect(ray);
+                dists.push_back(hit.has_value() ? hit->dist : -1);
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        std::cout << (useBlocks ? "blocks" : "one by one") << ": " << std::chrono::duration<double, std::milli>(end - start).count() << " ms, "
+                  << bvh.getStats().memoryBytes / 1024.0 << " KiB" << std::endl;
+    };
+    std::vector<float> withBlocks, withoutBlocks;
+    report(true, withBlocks);
+    report(false, withoutBlocks);
+    int distMismatches = 0;
+    for (size_t i = 0; i < rays.size(); i++)
+    {
+        distMismatches += withBlocks[i] != withoutBlocks[i];
+    }
+    std::cout << "closest hit mismatches: " << distMismatches << " / " << rays.size() << std::endl;
+}
+
+void testDeferredHit()
+{
+    std::cout << "========== testDeferredHit ==========" << std::endl;
+    std::optional<std::vector<Triangle>> triangles = Triangle::loadModel("models/bunny/bunny.obj");
+    if (!triangles.has_value())
+    {
+        std::cout << "Failed to load model" << std::endl;
+        return;
+    }
+
+    // the brute-force scene and the BVH both build the payload only for the nearest hit
+    Camera camera(800, 600, 90.0f);
+    Scene scene(camera, cv::Vec3f(0, 0, 0));
+    std::vector<std::shared_ptr<Object>> objects;
+    AABB bound;
+    for (const auto &tri : triangles.value())
+    {
+        objects.push_back(std::make_shared<Triangle>(tri));
+        bound = bound + tri.getAABB();
+    }
+    objects.push_back(std::make_shared<Sphere>(bound.getCentroid(), bound.getDiagonal()[0] * 0.2f));
+    for (const auto &object : objects)
+    {
+        scene.add(object);
+    }
+    BVH bvh(objects);
+
+    auto compare = [](const Scene &scene, const BVH &bvh, const AABB &bound, int &hits) {
+        int mismatches = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            Ray ray = randomRay(bound);
+            std::optional<HitPayload> brute = scene.trace(ray);
+            std::optional<HitPayload> fast = bvh.intersect(ray);
+            hits += brute.has_value();
+            if (brute.has_value() != fast.has_value())
+            {
+                mismatches++;
+            }
+            else if (brute.has_value())
+            {
+                mismatches += brute->hitObj != fast->hitObj || brute->dist != fast->dist || brute->point != fast->point || brute->normal != fast->normal;
+            }
+        }
+        return mismatches;
+    };
+    int hits = 0;
+    int mismatches = compare(scene, bvh, bound, hits);
+    std::cout << "sizeof(HitPayload) = " << sizeof(HitPayload) << ", hits " << hits << ", mismatches " << mismatches << std::endl;
+
+    // instances record the primitive of their bottom-level BVH, the payload is built from it without a second traversal
+    std::vector<std::shared_ptr<Object>> mesh(objects.begin(), objects.end() - 1);
+    std::shared_ptr<const BVH> blas = std::make_shared<BVH>(mesh);
+    Scene instanceScene(camera, cv::Vec3f(0, 0, 0));
+    std::vector<std::shared_ptr<Object>> instances;
+    for (const cv::Matx44f &m : { cv::Matx44f(1, 0, 0, 0.3, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1), cv::Matx44f(0, 0, 2, -0.3, 0, 2, 0, 0, -2, 0, 0, 0, 0, 0, 0, 1) })
+    {
+        instances.push_back(std::make_shared<Instance>(blas, m));
+        instanceScene.add(instances.back());
+    }
+    BVH tlas(instances);
+    hits = 0;
+    mismatches = compare(instanceScene, tlas, tlas.getNodes()[0].aabb, hits);
+    std::cout << "instanced: hits " << hits << ", mismatches " << mismatches << std::endl;
+}
+
+void testDepthLimit()
+{
+    std::cout << "========== testDepthLimit ==========" << std::endl;
+    // triangles at doubling distances, with two bins every object split peels off only the farthest one
+    const int n = 120;
+    std::vector<std::shared_ptr<Object>> objects;
+    for (int k = 0; k < n; k++)
+    {
+        float x = std::ldexp(1.0f, k);
+        objects.push_back(std::make_shared<Triangle>(std::array<cv::Vec3f, 3>{ cv::Vec3f(x, 0, 0), cv::Vec3f(x, 1, 0), cv::Vec3f(x, 0, 1) }));
+    }
+
+    BVHBuildConfig config;
+    config.nBuckets = 2;
+    for (auto method : { BVHBuildConfig::SplitMethod::SAH, BVHBuildConfig::SplitMethod::SBVH })
+    {
+        config.splitMethod = method;
+        BVH bvh(objects, config);
+        int mismatches = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            // rays along +x starting between two triangles, the nearest one sits deep in the skewed tree
+            float y = zoe::randomFloat() * 0.5f;
+            float z = zoe::randomFloat() * 0.5f;
+            Ray ray(cv::Vec3f(std::ldexp(0.75f, static_cast<int>(zoe::randomFloat() * n)), y, z), cv::Vec3f(1, 0, 0));
+            float nearest = std::numeric_limits<float>::infinity();
+            for (const auto &object : objects)
+            {
+                std::optional<HitPayload> hit = object->intersect(ray);
+                if (hit.has_value())
+                {
+                    nearest = std::min(nearest, hit->dist);
+                }
+            }
+            std::optional<HitPayload> hit = bvh.intersect(ray);
+            mismatches += hit.has_value() ? hit->dist != nearest : nearest != std::numeric_limits<float>::infinity();
+        }
+        std::cout << (method == BVHBuildConfig::SplitMethod::SAH ? "SAH" : "SBVH") << " max depth " << bvh.getStats().maxDepth 
+            << ", mismatches " << mismatches << " / 1000" << std::endl;
+    }
+}
+
+void testSpatialSplits()
+{
+    std::cout << "========== testSpatialSplits ==========" << std::endl;
+    std::optional<std::vector<Triangle>> triangles = Triangle::loadModel("models/stairscase/stairscase.obj");
+    if (!triangles.has_value())
+    {
+        std::cout << "Failed to load model" << std::endl;
+        return;
+    }
+    std::vector<std::shared_ptr<Object>> objects;
+    AABB bound;
+    for (const auto &tri : triangles.value())
+    {
+        objects.push_back(std::make_shared<Triangle>(tri));
+        bound = bound + tri.getAABB();
+    }
+
+    BVHBuildConfig config;
+    config.splitMethod = BVHBuildConfig::SplitMethod::SBVH;
+    BVH bvh(objects, config);
+    std::cout << "references " << bvh.getStats().primitives << " for " << objects.size() << " objects" << std::endl;
+
+    // duplicated references must neither lose nor double-count a hit
+    int closestMismatches = 0;
+    int occlusionMismatches = 0;
+    for (int i = 0; i < 10000; i++)
+    {
+        Ray ray = randomRay(bound);
+        float nearest = std::numeric_limits<float>::infinity();
+        for (const auto &object : objects)
+        {
+            std::optional<HitPayload> hit = object->intersect(ray);
+            if (hit.has_value())
+            {
+                nearest = std::min(nearest, hit->dist);
+            }
+        }
+        std::optional<HitPayload> hit = bvh.intersect(ray);
+        closestMismatches += hit.has_value() ? hit->dist != nearest : nearest != std::numeric_limits<float>::infinity();
+        bool blocked = !std::isinf(nearest);
+        occlusionMismatches += bvh.occluded(ray, std::numeric_limits<float>::infinity()) != blocked;
+        if (blocked)
+        {
+            // nothing lies in front of the nearest hit
+            occlusionMismatches += bvh.occluded(ray, nearest * 0.5f);
+        }
+    }
+    std::cout << "closest hit mismatches " << closestMismatches << ", occlusion mismatches " << occlusionMismatches << " / 10000" << std::endl;
+}
+
+void testCacheCorruption()
+{
+    std::cout << "========== testCacheCorruption ==========" << std::endl;
+    std::optional<std::vector<Triangle>> triangles = Triangle::loadModel("models/bunny/bunny.obj");
+    if (!triangles.has_value())
+    {
+        std::cout << "Failed to load model" << std::endl;
+        return;
+    }
+    std::vector<std::shared_ptr<Object>> objects;
+    for (const auto &tri : triangles.value())
+    {
+        objects.push_back(std::make_shared<Triangle>(tri));
+    }
+    BVH bvh(objects);
+    const std::string path = "output/testCacheCorruption.bvh";
+    if (!bvh.saveCache(path))
+    {
+        return;
+    }
+    std::ifstream in(path, std::ios::binary);
+    std::vector<char> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+
+    // the header is followed by the nodes and then the primitive order
+    const std::vector<BVH::LinearBVHNode> &nodes = bvh.getNodes();
+    size_t nodesOffset = file.size() - nodes.size() * sizeof(BVH::LinearBVHNode) - bvh.getPrimitives().size() * sizeof(int);
+    int leaf = 0;
+    while (nodes[leaf].nPrimitives == 0)
+    {
+        leaf++;
+    }
+    auto load = [&](int node, int value) {
+        std::vector<char> corrupted = file;
+        if (node >= 0)
+        {
+            // secondChildOffset and primitivesOffset share the int after the bounds
+            std::memcpy(&corrupted[nodesOffset + node * sizeof(BVH::LinearBVHNode) + sizeof(AABB)], &value, sizeof(int));
+        }
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(corrupted.data(), corrupted.size());
+        out.close();
+        return BVH::loadCache(path, objects, bvh.getConfig()) != nullptr;
+    };
+    std::cout << "intact: " << (load(-1, 0) ? "loaded" : "rejected") << std::endl;
+    std::cout << "root pointing to itself: " << (load(0, 0) ? "loaded" : "rejected") << std::endl;
+    std::cout << "second child past the end: " << (load(0, nodes.size()) ? "loaded" : "rejected") << std::endl;
+    std::cout << "leaf past the primitives: " << (load(leaf, bvh.getPrimitives().size()) ? "loaded" : "rejected") << std::endl;
+    std::remove(path.c_str());
+}
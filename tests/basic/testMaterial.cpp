@@ -0,0 +1,70 @@
+#include "common/utils.h"
+#include "objects/Material.h"
+
+namespace {
+
+// the integral of eval * cos over the upper hemisphere, estimated with uniform directions
+cv::Vec3f integrateReflection(const Material &material, const cv::Vec3f &normal, const cv::Vec3f &wi, int n)
+{
+    // summed in double, a float sum of a million terms is off by about a percent
+    cv::Vec3d sum(0, 0, 0);
+    for (int i = 0; i < n; i++)
+    {
+        float z = zoe::randomFloat();
+        float r = std::sqrt(1 - z * z);
+        float phi = 2 * M_PI * zoe::randomFloat();
+        cv::Vec3f wo = zoe::localToWorld(cv::Vec3f(r * std::cos(phi), r * std::sin(phi), z), normal);
+        sum += cv::Vec3d(material.eval(normal, wi, wo) * wo.dot(normal) * (2 * M_PI));
+    }
+    return cv::Vec3f(sum / n);
+}
+
+}
+
+int main()
+{
+    const char *names[] = { "DIFFUSE_AND_GLOSSY", "REFLECTION_AND_REFRACTION", "REFLECTION", "DIFFUSE_AND_REFLECTION", "DIFFUSE_AND_REFRACTION" };
+    const Material::MaterialType types[] = {
+        Material::MaterialType::DIFFUSE_AND_GLOSSY,
+        Material::MaterialType::REFLECTION_AND_REFRACTION,
+        Material::MaterialType::REFLECTION,
+        Material::MaterialType::DIFFUSE_AND_REFLECTION,
+        Material::MaterialType::DIFFUSE_AND_REFRACTION
+    };
+    cv::Vec3f normal(0, 0, 1);
+    cv::Vec3f wi = cv::normalize(cv::Vec3f(0.3, 0.2, -1));
+    const int n = 1000000;
+
+    // value * |cos| / pdf averaged over sample must match the albedo, and pdf must match what sample reports
+    for (int t = 0; t < 5; t++)
+    {
+        Material material(types[t], cv::Vec3f(0, 0, 0), cv::Vec3f(0.5, 0.4, 0.3), cv::Vec3f(0.2, 0.2, 0.2), cv::Vec3f(0.9, 0.8, 0.7), 25.0f, 1.5f);
+        float fr = zoe::fresnel(wi, normal, material.ior);
+        cv::Vec3f transmitted = (1 - fr) * material.tr;
+        cv::Vec3f expected;
+        switch (types[t])
+        {
+            case Material::MaterialType::DIFFUSE_AND_GLOSSY: expected = material.kd; break;
+            case Material::MaterialType::REFLECTION_AND_REFRACTION: expected = cv::Vec3f(fr, fr, fr) + transmitted; break;
+            case Material::MaterialType::REFLECTION: expected = cv::Vec3f(fr, fr, fr); break;
+            case Material::MaterialType::DIFFUSE_AND_REFLECTION: expected = integrateReflection(material, normal, wi, n); break;
+            case Material::MaterialType::DIFFUSE_AND_REFRACTION: expected = material.kd + transmitted; break;
+        }
+
+        cv::Vec3d estimate(0, 0, 0);
+        int pdfMismatches = 0;
+        for (int i = 0; i < n; i++)
+        {
+            BSDFSample s = material.sample(normal, wi);
+            if (s.pdf > 0)
+            {
+                estimate += cv::Vec3d(s.value * std::fabs(s.dir.dot(normal)) / s.pdf);
+            }
+            pdfMismatches += std::fabs(material.pdf(normal, wi, s.dir) - s.pdf) > 1e-4f * s.pdf;
+        }
+        estimate /= n;
+        std::cout << names[t] << ": expected " << expected << ", estimate " << estimate << ", pdf mismatches " << pdfMismatches << std::endl;
+    }
+
+    return 0;
+}
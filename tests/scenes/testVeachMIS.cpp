@@ -0,0 +1,53 @@
+#include <iostream>
+#include "objects/Triangle.h"
+#include "objects/ModelLoader.h"
+#include "Scene.h"
+#include "Renderer.h"
+
+namespace {
+
+// radiance is clamped so that single fireflies do not dominate the error
+double rmse(const cv::Mat3f &a, const cv::Mat3f &b)
+{
+    const float maxRadiance = 50.0f;
+    double sum = 0;
+    for (int j = 0; j < a.rows; j++)
+    {
+        for (int i = 0; i < a.cols; i++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                double d = std::min(a(j, i)[c], maxRadiance) - std::min(b(j, i)[c], maxRadiance);
+                sum += d * d;
+            }
+        }
+    }
+    return std::sqrt(sum / (a.rows * a.cols * 3.0));
+}
+
+}
+
+// renders veach-mis with and without MIS and compares both against a reference rendered with MIS
+int main(int argc, char **argv)
+{
+    int referenceSpp = argc > 1 ? std::stoi(argv[1]) : 1024;
+    std::string sceneName = "models/veachmis/veach-mis.obj";
+    BVHScene scene = ModelLoader::loadBVHScene(sceneName);
+    scene.buildBVH();
+
+    scene.setMIS(true);
+    cv::Mat3f reference = RayTracer(referenceSpp, 1).render(scene);
+    cv::imwrite("output/veachmis/testVeachMIS-reference-" + std::to_string(referenceSpp) + ".png", reference * 255);
+
+    for (int spp : { 16, 64, 256 })
+    {
+        for (bool mis : { true, false })
+        {
+            scene.setMIS(mis);
+            cv::Mat3f image = RayTracer(spp, 1).render(scene);
+            std::cout << "spp " << spp << (mis ? ", MIS" : ", light sampling only") << ": rmse " << rmse(image, reference) << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+#include <iostream>
+#include "objects/Triangle.h"
+#include "objects/ModelLoader.h"
+#include "Scene.h"
+#include "Renderer.h"
+
+// renders veach-mis with RayTracer and WavefrontTracer, both print their MRays/s
+int main(int argc, char **argv)
+{
+    int spp = argc > 1 ? std::stoi(argv[1]) : 16;
+    std::string sceneName = "models/veachmis/veach-mis.obj";
+    BVHScene scene = ModelLoader::loadBVHScene(sceneName);
+    scene.buildBVH();
+
+    RayTracer megakernel(spp, 1);
+    cv::Mat3f megakernelImage = megakernel.render(scene);
+    WavefrontTracer wavefront(spp);
+    cv::Mat3f wavefrontImage = wavefront.render(scene);
+    cv::imwrite("output/veachmis/testWavefront-megakernel-" + std::to_string(spp) + ".png", megakernelImage * 255);
+    cv::imwrite("output/veachmis/testWavefront-wavefront-" + std::to_string(spp) + ".png", wavefrontImage * 255);
+
+    // both estimate the same integral, so the means agree and the difference is noise
+    cv::Scalar megakernelMean = cv::mean(megakernelImage);
+    cv::Scalar wavefrontMean = cv::mean(wavefrontImage);
+    double rmse = cv::norm(megakernelImage, wavefrontImage, cv::NORM_L2) / std::sqrt(megakernelImage.total() * 3.0);
+    std::cout << "mean megakernel " << (megakernelMean[0] + megakernelMean[1] + megakernelMean[2]) / 3
+              << ", wavefront " << (wavefrontMean[0] + wavefrontMean[1] + wavefrontMean[2]) / 3
+              << ", rmse " << rmse << std::endl;
+
+    return 0;
+}